@@ -0,0 +1,417 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+#include "strqueue.h"
+
+using std::string;
+using std::vector;
+
+using namespace cxx;
+
+namespace {
+
+// queue kinds measured by the benchmarks taking a backend argument
+const vector<int64_t> backends = {STRQUEUE_DEQUE, STRQUEUE_TREE, STRQUEUE_ARENA,
+                                    STRQUEUE_INTERN};
+
+const char *backend_name(int64_t kind) {
+    switch (kind) {
+        case STRQUEUE_TREE:
+            return "tree";
+        case STRQUEUE_ARENA:
+            return "arena";
+        case STRQUEUE_INTERN:
+            return "intern";
+        default:
+            return "deque";
+    }
+}
+
+// where in the queue an operation takes place
+enum placement : int64_t { head, middle, tail };
+
+size_t position_in(size_t size, int64_t where) {
+    switch (where) {
+        case head:
+            return 0;
+        case middle:
+            return size / 2;
+        default:
+            return size == 0 ? 0 : size - 1;
+    }
+}
+
+// a queue of the given kind filled with size strings of length len
+unsigned long make_queue(int64_t kind, size_t size, size_t len) {
+    const unsigned long id = strqueue_new_ex(static_cast<unsigned int>(kind));
+    string str(len, 'x');
+    vector<const char*> strs(size, str.c_str());
+
+    strqueue_push_back_n(id, strs.data(), strs.size());
+
+    return id;
+}
+
+void label(benchmark::State &state, int64_t kind) {
+    state.SetLabel(backend_name(kind));
+}
+
+void BM_NewDelete(benchmark::State &state) {
+    for (auto _ : state)
+        strqueue_delete(strqueue_new_ex(static_cast<unsigned int>(state.range(0))));
+
+    label(state, state.range(0));
+}
+BENCHMARK(BM_NewDelete)->ArgsProduct({backends});
+
+// args: placement, queue size, string length, backend;
+// every iteration inserts a string and removes it again
+void BM_InsertRemove(benchmark::State &state) {
+    const size_t size = state.range(1), len = state.range(2);
+    const unsigned long id = make_queue(state.range(3), size, len);
+    const size_t position = position_in(size + 1, state.range(0));
+    const string str(len, 'y');
+
+    for (auto _ : state) {
+        strqueue_insert_at(id, position, str.c_str());
+        strqueue_remove_at(id, position);
+    }
+
+    strqueue_delete(id);
+    state.SetBytesProcessed(state.iterations() * len);
+    label(state, state.range(3));
+}
+BENCHMARK(BM_InsertRemove)->ArgsProduct({
+    {head, middle, tail}, {1 << 10, 1 << 16}, {8, 64, 256}, backends});
+
+// args: placement, queue size, backend; the 10^6 element case
+// guards against positional lookup becoming linear again
+void BM_GetAt(benchmark::State &state) {
+    const size_t size = state.range(1);
+    const unsigned long id = make_queue(state.range(2), size, 16);
+    const size_t position = position_in(size, state.range(0));
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(strqueue_get_at(id, position));
+
+    strqueue_delete(id);
+    label(state, state.range(2));
+}
+BENCHMARK(BM_GetAt)->ArgsProduct({{head, middle, tail}, {1 << 10, 1000000}, backends});
+
+// args: queue size, backend, whether the elements are read through the
+// iterators of strqueue_handle instead of strqueue_get_at one by one
+void BM_Iterate(benchmark::State &state) {
+    const size_t size = state.range(0);
+    const strqueue_handle queue = strqueue_handle::adopt(make_queue(state.range(1), size, 16));
+
+    for (auto _ : state) {
+        size_t total = 0;
+
+        if (state.range(2) != 0) {
+            for (std::string_view str : queue)
+                total += str.size();
+        } else {
+            for (size_t i = 0; i < size; ++i)
+                total += *strqueue_get_at(queue.id(), i);
+        }
+
+        benchmark::DoNotOptimize(total);
+    }
+
+    state.SetItemsProcessed(state.iterations() * size);
+    label(state, state.range(1));
+}
+BENCHMARK(BM_Iterate)->ArgsProduct({{1 << 10, 1 << 16}, backends, {0, 1}});
+
+// args: queue size, string length, backend
+void BM_Clear(benchmark::State &state) {
+    const size_t size = state.range(0), len = state.range(1);
+    const unsigned long id = strqueue_new_ex(static_cast<unsigned int>(state.range(2)));
+    const string str(len, 'x');
+    vector<const char*> strs(size, str.c_str());
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        strqueue_push_back_n(id, strs.data(), size);
+        state.ResumeTiming();
+
+        strqueue_clear(id);
+    }
+
+    strqueue_delete(id);
+    label(state, state.range(2));
+}
+BENCHMARK(BM_Clear)->ArgsProduct({{1 << 10, 1 << 16}, {8, 256}, backends});
+
+// args: queue size, string length, backend, whether the queue is created
+// with strqueue_new_with_capacity for all its strings
+void BM_Fill(benchmark::State &state) {
+    const size_t size = state.range(0), len = state.range(1);
+    const unsigned int kind = static_cast<unsigned int>(state.range(2));
+    const string str(len, 'x');
+
+    for (auto _ : state) {
+        const unsigned long id = state.range(3) ? strqueue_new_with_capacity(kind, size, size * len)
+                                                : strqueue_new_ex(kind);
+
+        for (size_t i = 0; i < size; i++)
+            strqueue_insert_at(id, i, str.c_str());
+
+        state.PauseTiming();
+        strqueue_delete(id);
+        state.ResumeTiming();
+    }
+
+    state.SetBytesProcessed(state.iterations() * size * len);
+    label(state, state.range(2));
+}
+BENCHMARK(BM_Fill)->ArgsProduct({{1 << 10, 1 << 16}, {8, 256}, backends, {0, 1}});
+
+// args: queue size, string length, backend, whether the last elements differ
+void BM_Comp(benchmark::State &state) {
+    const size_t size = state.range(0), len = state.range(1);
+    const unsigned long id1 = make_queue(state.range(2), size, len);
+    const unsigned long id2 = make_queue(state.range(2), size, len);
+
+    if (state.range(3) != 0) {
+        strqueue_remove_at(id2, size - 1);
+        strqueue_insert_at(id2, size - 1, string(len, 'z').c_str());
+    }
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(strqueue_comp(id1, id2));
+
+    strqueue_delete(id1);
+    strqueue_delete(id2);
+    state.SetBytesProcessed(state.iterations() * size * len * 2);
+    label(state, state.range(2));
+}
+BENCHMARK(BM_Comp)->ArgsProduct({{1 << 10, 1 << 16}, {8, 256}, backends, {0, 1}});
+
+// args: queue size, string length, backend, whether the queue is indexed;
+// the string searched for is the last element
+void BM_Find(benchmark::State &state) {
+    const size_t size = state.range(0), len = state.range(1);
+    const unsigned long id = make_queue(state.range(2), size - 1, len);
+    const string str(len, 'y');
+
+    strqueue_insert_at(id, size - 1, str.c_str());
+    strqueue_set_indexed(id, static_cast<int>(state.range(3)));
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(strqueue_find(id, str.c_str(), 0));
+
+    strqueue_delete(id);
+    state.SetBytesProcessed(state.iterations() * size * len);
+    label(state, state.range(2));
+}
+BENCHMARK(BM_Find)->ArgsProduct({{1 << 10, 1 << 16}, {8, 256}, backends, {0, 1}});
+
+// args: queue size, backend, whether the queue is indexed;
+// the string searched for is absent
+void BM_Contains(benchmark::State &state) {
+    const unsigned long id = make_queue(state.range(1), state.range(0), 16);
+
+    strqueue_set_indexed(id, static_cast<int>(state.range(2)));
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(strqueue_contains(id, "absent"));
+
+    strqueue_delete(id);
+    label(state, state.range(1));
+}
+BENCHMARK(BM_Contains)->ArgsProduct({{1 << 10, 1 << 16}, backends, {0, 1}});
+
+// args: number of queues, queue size; every queue is compared with
+// a reference equal to it, so that the comparisons go through every element
+void BM_CompMany(benchmark::State &state) {
+    const size_t n = state.range(0), size = state.range(1);
+    const unsigned long ref = make_queue(STRQUEUE_DEQUE, size, 16);
+    vector<unsigned long> ids(n);
+    vector<int> out(n);
+
+    for (auto &id : ids)
+        id = make_queue(STRQUEUE_DEQUE, size, 16);
+
+    for (auto _ : state)
+        strqueue_comp_many(ref, ids.data(), n, out.data());
+
+    strqueue_delete_many(ids.data(), n);
+    strqueue_delete(ref);
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_CompMany)->ArgsProduct({{1 << 10, 1 << 14}, {16, 1 << 10}})->UseRealTime();
+
+// args: string length, record format; 2^16 strings are written to
+// a temporary file
+void BM_DumpFd(benchmark::State &state) {
+    const size_t size = 1 << 16, len = state.range(0);
+    const unsigned long id = make_queue(STRQUEUE_DEQUE, size, len);
+    const unsigned int format = static_cast<unsigned int>(state.range(1));
+    FILE *file = tmpfile();
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        ftruncate(fileno(file), 0);
+        lseek(fileno(file), 0, SEEK_SET);
+        state.ResumeTiming();
+
+        strqueue_dump_fd(id, fileno(file), format);
+    }
+
+    fclose(file);
+    strqueue_delete(id);
+    state.SetBytesProcessed(state.iterations() * size * len);
+}
+BENCHMARK(BM_DumpFd)->ArgsProduct({{8, 256}, {STRQUEUE_LINES, STRQUEUE_LENGTH_PREFIXED}});
+
+// args: string length, record format, backend; the file written by
+// strqueue_dump_fd is read back into an emptied queue
+void BM_LoadFd(benchmark::State &state) {
+    const size_t size = 1 << 16, len = state.range(0);
+    const unsigned long source = make_queue(STRQUEUE_DEQUE, size, len);
+    const unsigned long id = strqueue_new_ex(static_cast<unsigned int>(state.range(2)));
+    const unsigned int format = static_cast<unsigned int>(state.range(1));
+    FILE *file = tmpfile();
+
+    strqueue_dump_fd(source, fileno(file), format);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        strqueue_clear(id);
+        lseek(fileno(file), 0, SEEK_SET);
+        state.ResumeTiming();
+
+        benchmark::DoNotOptimize(strqueue_load_fd(id, fileno(file), format));
+    }
+
+    fclose(file);
+    strqueue_delete(source);
+    strqueue_delete(id);
+    state.SetBytesProcessed(state.iterations() * size * len);
+    label(state, state.range(2));
+}
+BENCHMARK(BM_LoadFd)->ArgsProduct({{8, 256}, {STRQUEUE_LINES, STRQUEUE_LENGTH_PREFIXED},
+                                    backends});
+
+#ifdef STRQUEUE_THREAD_SAFE
+// every thread works on a queue of its own, measuring how well
+// operations on different queues scale with the number of threads
+void BM_MultiThreaded(benchmark::State &state) {
+    const unsigned long id = make_queue(STRQUEUE_DEQUE, 1 << 10, 16);
+    const string str(16, 'y');
+
+    for (auto _ : state) {
+        strqueue_insert_at(id, 512, str.c_str());
+        benchmark::DoNotOptimize(strqueue_get_at(id, 256));
+        benchmark::DoNotOptimize(strqueue_size(id));
+        strqueue_remove_at(id, 512);
+    }
+
+    strqueue_delete(id);
+    state.SetItemsProcessed(state.iterations() * 4);
+}
+BENCHMARK(BM_MultiThreaded)->ThreadRange(1, 64)->UseRealTime();
+
+// args: whether the arena queue of every thread is created on the node
+// the thread runs on, which makes a difference in STRQUEUE_NUMA builds
+void BM_MultiThreadedOnNode(benchmark::State &state) {
+    const unsigned long id = state.range(0) ? strqueue_new_on(STRQUEUE_ARENA, STRQUEUE_LOCAL_NODE)
+                                            : strqueue_new_ex(STRQUEUE_ARENA);
+    const string str(16, 'y');
+    vector<const char*> strs(1 << 10, str.c_str());
+
+    strqueue_push_back_n(id, strs.data(), strs.size());
+
+    for (auto _ : state) {
+        strqueue_insert_at(id, 512, str.c_str());
+        benchmark::DoNotOptimize(strqueue_get_at(id, 256));
+        benchmark::DoNotOptimize(strqueue_size(id));
+        strqueue_remove_at(id, 512);
+    }
+
+    strqueue_delete(id);
+    state.SetItemsProcessed(state.iterations() * 4);
+}
+BENCHMARK(BM_MultiThreadedOnNode)->Arg(0)->Arg(1)->ThreadRange(1, 64)->UseRealTime();
+
+// every thread pushes and pops on one shared MPMC FIFO queue
+void BM_FifoMpmc(benchmark::State &state) {
+    static unsigned long id;
+    const string str(16, 'y');
+
+    if (state.thread_index() == 0)
+        id = strqueue_new_fifo(STRQUEUE_FIFO_MPMC, 1 << 16);
+
+    for (auto _ : state) {
+        strqueue_push(id, str.c_str());
+        free(strqueue_pop(id));
+    }
+
+    if (state.thread_index() == 0)
+        strqueue_delete(id);
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_FifoMpmc)->ThreadRange(1, 64)->UseRealTime();
+
+// same as above through handles, which skip the registry lookup
+void BM_FifoMpmcHandle(benchmark::State &state) {
+    static unsigned long id;
+    const string str(16, 'y');
+    strqueue_fifo *fifo = nullptr;
+    char buf[64];
+
+    if (state.thread_index() == 0)
+        id = strqueue_new_fifo(STRQUEUE_FIFO_MPMC, 1 << 16);
+
+    for (auto _ : state) {
+        // the queue exists once the loop has started in every thread
+        if (fifo == nullptr)
+            fifo = strqueue_fifo_acquire(id);
+
+        strqueue_fifo_push(fifo, str.c_str());
+        char *res = strqueue_fifo_pop(fifo, buf, sizeof(buf));
+
+        if (res != buf)
+            free(res);
+    }
+
+    strqueue_fifo_release(fifo);
+    if (state.thread_index() == 0)
+        strqueue_delete(id);
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_FifoMpmcHandle)->ThreadRange(1, 64)->UseRealTime();
+#endif
+} // namespace
+
+int main(int argc, char **argv) {
+    // perf dashboards consume JSON, so it is the default output format
+    vector<char*> args(argv, argv + argc);
+    string format = "--benchmark_format=json";
+    bool has_format = false;
+
+    for (int i = 1; i < argc; ++i)
+        has_format |= string(argv[i]).rfind("--benchmark_format", 0) == 0;
+
+    if (!has_format)
+        args.push_back(format.data());
+
+    int args_count = static_cast<int>(args.size());
+
+    benchmark::Initialize(&args_count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(args_count, args.data()))
+        return 1;
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return 0;
+}
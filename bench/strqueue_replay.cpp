@@ -0,0 +1,817 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "strqueue.h"
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+using namespace cxx;
+
+// every allocation of the process is counted, through malloc where it
+// can be replaced and operator new elsewhere; sanitizers bring their own
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define STRQUEUE_REPLAY_MALLOC
+#endif
+
+namespace {
+
+std::atomic<size_t> allocations{0};
+
+void count_allocation(void) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+} // namespace
+
+#ifdef STRQUEUE_REPLAY_MALLOC
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    count_allocation();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+} // extern "C"
+#endif
+
+namespace {
+
+void *allocate(size_t size, size_t alignment) {
+#ifndef STRQUEUE_REPLAY_MALLOC
+    count_allocation();
+#endif
+
+    if (size == 0)
+        size = 1;
+
+    void *ptr;
+#ifdef STRQUEUE_REPLAY_MALLOC
+    if (alignment > alignof(std::max_align_t)) {
+        count_allocation();
+        ptr = __libc_memalign(alignment, size);
+    }
+    else {
+        ptr = std::malloc(size);
+    }
+#else
+    ptr = alignment > alignof(std::max_align_t)
+        ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+        : std::malloc(size);
+#endif
+
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+
+    return ptr;
+}
+
+} // namespace
+
+void *operator new(size_t size) {
+    return allocate(size, 0);
+}
+
+void *operator new[](size_t size) {
+    return allocate(size, 0);
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<size_t>(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+namespace {
+
+using steady = std::chrono::steady_clock;
+
+// the arguments of a traced call; numbers in order, and the one string,
+// array of strings or array of IDs there is in any call
+struct parsed_call {
+    vector<unsigned long long> numbers;
+    string str;
+    bool null = false;
+    vector<string> strs;
+    vector<bool> nulls;
+    vector<unsigned long> ids;
+
+    const char *c_str(void) const {
+        return null ? NULL : str.c_str();
+    }
+
+    vector<const char*> c_strs(void) const {
+        vector<const char*> res(strs.size());
+
+        for (size_t i = 0; i < strs.size(); ++i)
+            res[i] = nulls[i] ? NULL : strs[i].c_str();
+
+        return res;
+    }
+};
+
+// IDs of the traced process mapped to those of the replayed queues;
+// IDs never created in the trace are passed on unchanged
+std::unordered_map<unsigned long, unsigned long> queue_ids;
+
+unsigned long queue(unsigned long long traced) {
+    const auto it = queue_ids.find(traced);
+    return it == queue_ids.end() ? traced : it->second;
+}
+
+// latencies in nanoseconds of the function being replayed
+vector<uint64_t> *samples;
+
+template<typename F>
+auto timed(F &&f) {
+    const auto start = steady::now();
+
+    if constexpr (std::is_void_v<decltype(f())>) {
+        f();
+        samples->push_back((steady::now() - start) / std::chrono::nanoseconds(1));
+    } else {
+        auto res = f();
+        samples->push_back((steady::now() - start) / std::chrono::nanoseconds(1));
+        return res;
+    }
+}
+
+// a replayed function; signature has an n for every number and an s, a
+// or i for the string, array of strings or array of IDs among them;
+// run returns the ID of the queue it created, if it is a constructor
+struct replayer {
+    const char *name;
+    const char *signature;
+    unsigned long (*run)(const parsed_call &call);
+};
+
+constexpr unsigned long none = STRQUEUE_NO_ID;
+
+const replayer replayers[] = {
+    {"strqueue_new", "", [](const parsed_call &) {
+        return timed([] { return strqueue_new(); });
+    }},
+    {"strqueue_new_ex", "n", [](const parsed_call &c) {
+        return timed([&] { return strqueue_new_ex(c.numbers[0]); });
+    }},
+    {"strqueue_new_with_capacity", "nnn", [](const parsed_call &c) {
+        return timed([&] {
+            return strqueue_new_with_capacity(c.numbers[0], c.numbers[1], c.numbers[2]);
+        });
+    }},
+    {"strqueue_new_on", "nn", [](const parsed_call &c) {
+        return timed([&] {
+            return strqueue_new_on(c.numbers[0], static_cast<int>(c.numbers[1]));
+        });
+    }},
+    {"strqueue_new_fifo", "nn", [](const parsed_call &c) {
+        return timed([&] { return strqueue_new_fifo(c.numbers[0], c.numbers[1]); });
+    }},
+    {"strqueue_clone", "n", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        return timed([&] { return strqueue_clone(id); });
+    }},
+    {"strqueue_delete", "n", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { strqueue_delete(id); });
+        return none;
+    }},
+    {"strqueue_size", "n", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { return strqueue_size(id); });
+        return none;
+    }},
+    {"strqueue_insert_at", "nns", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { strqueue_insert_at(id, c.numbers[1], c.c_str()); });
+        return none;
+    }},
+    {"strqueue_insert_at_n", "nnsn", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { strqueue_insert_at_n(id, c.numbers[1], c.c_str(), c.numbers[2]); });
+        return none;
+    }},
+    {"strqueue_remove_at", "nn", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { strqueue_remove_at(id, c.numbers[1]); });
+        return none;
+    }},
+    {"strqueue_get_at", "nn", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { return strqueue_get_at(id, c.numbers[1]); });
+        return none;
+    }},
+    {"strqueue_view_at", "nn", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        strqueue_view view;
+        timed([&] { return strqueue_view_at(id, c.numbers[1], &view); });
+        return none;
+    }},
+    {"strqueue_view_valid", "nn", [](const parsed_call &c) {
+        const strqueue_view view{nullptr, 0, queue(c.numbers[0]), c.numbers[1]};
+        timed([&] { return strqueue_view_valid(&view); });
+        return none;
+    }},
+    {"strqueue_clear", "n", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { strqueue_clear(id); });
+        return none;
+    }},
+    {"strqueue_comp", "nn", [](const parsed_call &c) {
+        const unsigned long id1 = queue(c.numbers[0]), id2 = queue(c.numbers[1]);
+        timed([&] { return strqueue_comp(id1, id2); });
+        return none;
+    }},
+    {"strqueue_equal", "nn", [](const parsed_call &c) {
+        const unsigned long id1 = queue(c.numbers[0]), id2 = queue(c.numbers[1]);
+        timed([&] { return strqueue_equal(id1, id2); });
+        return none;
+    }},
+    {"strqueue_push_back_n", "nan", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        vector<const char*> strs = c.c_strs();
+        timed([&] { strqueue_push_back_n(id, strs.data(), strs.size()); });
+        return none;
+    }},
+    {"strqueue_insert_range_at", "nnan", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        vector<const char*> strs = c.c_strs();
+        timed([&] { strqueue_insert_range_at(id, c.numbers[1], strs.data(), strs.size()); });
+        return none;
+    }},
+    {"strqueue_remove_range", "nnn", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { strqueue_remove_range(id, c.numbers[1], c.numbers[2]); });
+        return none;
+    }},
+    {"strqueue_get_range", "nnn", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        vector<const char*> out(c.numbers[2]);
+        timed([&] { return strqueue_get_range(id, c.numbers[1], out.size(), out.data()); });
+        return none;
+    }},
+    {"strqueue_view_range", "nnn", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        vector<strqueue_view> out(c.numbers[2]);
+        timed([&] { return strqueue_view_range(id, c.numbers[1], out.size(), out.data()); });
+        return none;
+    }},
+    {"strqueue_push", "ns", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { return strqueue_push(id, c.c_str()); });
+        return none;
+    }},
+    {"strqueue_pop", "n", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        free(timed([&] { return strqueue_pop(id); }));
+        return none;
+    }},
+    {"strqueue_find", "nsn", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { return strqueue_find(id, c.c_str(), c.numbers[1]); });
+        return none;
+    }},
+    {"strqueue_contains", "ns", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { return strqueue_contains(id, c.c_str()); });
+        return none;
+    }},
+    {"strqueue_set_indexed", "nn", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { strqueue_set_indexed(id, static_cast<int>(c.numbers[1])); });
+        return none;
+    }},
+    {"strqueue_set_compressible", "nn", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { strqueue_set_compressible(id, static_cast<int>(c.numbers[1])); });
+        return none;
+    }},
+    {"strqueue_compress_idle", "", [](const parsed_call &) {
+        timed([] { return strqueue_compress_idle(); });
+        return none;
+    }},
+    {"strqueue_comp_many", "nin", [](const parsed_call &c) {
+        const unsigned long ref = queue(c.numbers[0]);
+        vector<unsigned long> ids(c.ids.size());
+        vector<int> out(ids.size());
+        std::transform(c.ids.begin(), c.ids.end(), ids.begin(), queue);
+        timed([&] { strqueue_comp_many(ref, ids.data(), ids.size(), out.data()); });
+        return none;
+    }},
+    {"strqueue_delete_many", "in", [](const parsed_call &c) {
+        vector<unsigned long> ids(c.ids.size());
+        std::transform(c.ids.begin(), c.ids.end(), ids.begin(), queue);
+        timed([&] { strqueue_delete_many(ids.data(), ids.size()); });
+        return none;
+    }},
+    {"strqueue_clear_many", "in", [](const parsed_call &c) {
+        vector<unsigned long> ids(c.ids.size());
+        std::transform(c.ids.begin(), c.ids.end(), ids.begin(), queue);
+        timed([&] { strqueue_clear_many(ids.data(), ids.size()); });
+        return none;
+    }},
+    {"strqueue_queue_stats", "n", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        struct strqueue_queue_stats stats;
+        timed([&] { return strqueue_queue_stats(id, &stats); });
+        return none;
+    }},
+    {"strqueue_bytes", "n", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { return strqueue_bytes(id); });
+        return none;
+    }},
+    {"strqueue_set_byte_limit", "nn", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { strqueue_set_byte_limit(id, c.numbers[1]); });
+        return none;
+    }},
+    {"strqueue_reserve", "nnn", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { strqueue_reserve(id, c.numbers[1], c.numbers[2]); });
+        return none;
+    }},
+    {"strqueue_shrink_to_fit", "n", [](const parsed_call &c) {
+        const unsigned long id = queue(c.numbers[0]);
+        timed([&] { strqueue_shrink_to_fit(id); });
+        return none;
+    }},
+};
+
+bool parse_number(string_view text, unsigned long long &out) {
+    if (text.empty())
+        return false;
+
+    const bool negative = text[0] == '-';
+    if (negative)
+        text.remove_prefix(1);
+
+    if (text.empty() || text.size() > 20)
+        return false;
+
+    out = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9')
+            return false;
+        out = out * 10 + (c - '0');
+    }
+
+    if (negative)
+        out = -out;
+
+    return true;
+}
+
+// a string as printed by the trace: NULL or the bytes in quotes,
+// which are not escaped
+bool parse_string(string_view text, string &out, bool &null) {
+    null = text == "NULL";
+
+    if (null)
+        return true;
+    if (text.size() < 2 || text.front() != '"' || text.back() != '"')
+        return false;
+
+    out.assign(text.substr(1, text.size() - 2));
+    return true;
+}
+
+// {"a", NULL, "b"}; as the strings are not escaped, the only way to
+// split them is at every '", ' or ', NULL' between them, which strings
+// containing those misread
+bool parse_strings(string_view text, parsed_call &call) {
+    if (text.size() < 2 || text.front() != '{' || text.back() != '}')
+        return false;
+
+    text = text.substr(1, text.size() - 2);
+
+    while (!text.empty()) {
+        size_t end;
+
+        if (text.substr(0, 4) == "NULL")
+            end = 4;
+        else if (text[0] == '"')
+            end = std::min(text.find("\", ", 1), text.size() - 1) + 1;
+        else
+            return false;
+
+        call.strs.emplace_back();
+        call.nulls.push_back(false);
+
+        bool null;
+        if (!parse_string(text.substr(0, end), call.strs.back(), null))
+            return false;
+
+        call.nulls.back() = null;
+        text.remove_prefix(end);
+
+        if (!text.empty()) {
+            if (text.substr(0, 2) != ", ")
+                return false;
+            text.remove_prefix(2);
+        }
+    }
+
+    return true;
+}
+
+bool parse_ids(string_view text, parsed_call &call) {
+    if (text.size() < 2 || text.front() != '{' || text.back() != '}')
+        return false;
+
+    text = text.substr(1, text.size() - 2);
+
+    while (!text.empty()) {
+        const size_t end = std::min(text.find(", "), text.size());
+        unsigned long long id;
+
+        if (!parse_number(text.substr(0, end), id))
+            return false;
+
+        call.ids.push_back(id);
+        text.remove_prefix(std::min(end + 2, text.size()));
+    }
+
+    return true;
+}
+
+// splits args, the text between the parentheses of a traced call, by
+// signature; numbers are taken from both ends, so the string between
+// them is read exactly whatever it contains
+bool parse_args(string_view args, string_view signature, parsed_call &call) {
+    const size_t middle = signature.find_first_not_of('n');
+    const size_t front = std::min(middle, signature.size());
+    const size_t back = middle == string_view::npos ? 0 : signature.size() - middle - 1;
+    vector<unsigned long long> tail(back);
+
+    for (size_t i = 0; i < front; ++i) {
+        const size_t end = std::min(args.find(", "), args.size());
+        unsigned long long number;
+
+        if (!parse_number(args.substr(0, end), number))
+            return false;
+
+        call.numbers.push_back(number);
+        args.remove_prefix(std::min(end + 2, args.size()));
+    }
+
+    for (size_t i = back; i-- > 0;) {
+        const size_t start = args.rfind(", ");
+
+        if (start == string_view::npos || !parse_number(args.substr(start + 2), tail[i]))
+            return false;
+
+        args = args.substr(0, start);
+    }
+
+    call.numbers.insert(call.numbers.end(), tail.begin(), tail.end());
+
+    if (middle == string_view::npos)
+        return args.empty();
+
+    switch (signature[middle]) {
+        case 's':
+            return parse_string(args, call.str, call.null);
+        case 'a':
+            return parse_strings(args, call);
+        default:
+            return parse_ids(args, call);
+    }
+}
+
+const replayer *find_replayer(string_view name) {
+    for (const auto &r : replayers)
+        if (name == r.name)
+            return &r;
+
+    return nullptr;
+}
+
+uint64_t percentile(const vector<uint64_t> &sorted, double q) {
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(q * sorted.size()))];
+}
+
+// replays the trace in in whole repeat times and prints the latencies
+// of every function replayed; calls of the other functions are skipped;
+// returns the number of calls in the trace whose arguments could not
+// be parsed, which are skipped as well
+size_t replay(std::istream &in, size_t repeat) {
+    vector<string> lines;
+
+    for (string line; std::getline(in, line);)
+        lines.push_back(std::move(line));
+
+    vector<vector<uint64_t>> latencies(std::size(replayers));
+    std::unordered_map<string, size_t> skipped, unparsed;
+    size_t unparsed_calls = 0;
+
+    for (size_t round = 0; round < repeat; ++round) {
+        // queues created by a call, waiting for the ID it returned
+        vector<unsigned long> created(std::size(replayers), none);
+        queue_ids.clear();
+
+        for (const string &line : lines) {
+            const string_view text = line;
+            const size_t open = text.find('(');
+            const size_t returns = text.find(" returns ");
+
+            if (returns != string_view::npos && returns < open) {
+                const replayer *r = find_replayer(text.substr(0, returns));
+                unsigned long long traced;
+
+                if (r != nullptr && created[r - replayers] != none &&
+                        parse_number(text.substr(returns + 9), traced)) {
+                    queue_ids[traced] = created[r - replayers];
+                    created[r - replayers] = none;
+                }
+                continue;
+            }
+
+            if (text.substr(0, 9) != "strqueue_" || open == string_view::npos ||
+                    text.back() != ')')
+                continue;
+
+            const string_view name = text.substr(0, open);
+            const replayer *r = find_replayer(name);
+            parsed_call call;
+
+            if (r == nullptr) {
+                if (round == 0)
+                    ++skipped[string(name)];
+                continue;
+            }
+
+            if (!parse_args(text.substr(open + 1, text.size() - open - 2),
+                            r->signature, call)) {
+                if (round == 0) {
+                    ++unparsed[string(name)];
+                    ++unparsed_calls;
+                }
+                continue;
+            }
+
+            samples = &latencies[r - replayers];
+            created[r - replayers] = r->run(call);
+        }
+    }
+
+    std::printf("%-28s %10s %10s %10s %10s %10s\n", "function (ns)", "calls", "p50",
+                "p99", "p999", "max");
+
+    for (size_t i = 0; i < latencies.size(); ++i) {
+        auto &v = latencies[i];
+
+        if (v.empty())
+            continue;
+
+        std::sort(v.begin(), v.end());
+        std::printf("%-28s %10zu %10llu %10llu %10llu %10llu\n", replayers[i].name, v.size(),
+                    static_cast<unsigned long long>(percentile(v, 0.5)),
+                    static_cast<unsigned long long>(percentile(v, 0.99)),
+                    static_cast<unsigned long long>(percentile(v, 0.999)),
+                    static_cast<unsigned long long>(v.back()));
+    }
+
+    for (const auto &[name, count] : skipped)
+        std::fprintf(stderr, "skipped %zu calls of %s\n", count, name.c_str());
+
+    for (const auto &[name, count] : unparsed)
+        std::fprintf(stderr, "could not parse %zu calls of %s\n", count, name.c_str());
+
+    return unparsed_calls;
+}
+
+// queue kinds the allocation checks run on
+const unsigned int kinds[] = {STRQUEUE_DEQUE, STRQUEUE_TREE, STRQUEUE_ARENA, STRQUEUE_INTERN};
+
+const char *kind_name(unsigned int kind) {
+    switch (kind) {
+        case STRQUEUE_TREE:
+            return "tree";
+        case STRQUEUE_ARENA:
+            return "arena";
+        case STRQUEUE_INTERN:
+            return "intern";
+        default:
+            return "deque";
+    }
+}
+
+// allocations made by calls of op: the most of a single call and the
+// average, which includes the occasional growth of containers
+struct allocation_counts {
+    size_t max = 0;
+    double mean = 0;
+};
+
+template<typename F>
+allocation_counts count_allocations(F &&op) {
+    constexpr size_t calls = 4096;
+    allocation_counts res;
+    size_t total = 0;
+
+    for (size_t i = 0; i < calls; ++i) {
+        const size_t before = allocations.load(std::memory_order_relaxed);
+        op(i);
+        const size_t made = allocations.load(std::memory_order_relaxed) - before;
+
+        res.max = std::max(res.max, made);
+        total += made;
+    }
+
+    res.mean = static_cast<double>(total) / calls;
+    return res;
+}
+
+// checks that calls allocate no more than they should on average and
+// that no single call exceeds its own allocations plus those of growing
+// a container, on queues of 1024 strings too long to fit into
+// std::string; reads must not allocate at all; returns the number of
+// checks that failed
+size_t check_allocations(void) {
+    const string str(40, 'x'), other(40, 'y');
+    vector<const char*> strs(1024, str.c_str());
+    size_t failed = 0;
+
+    // the most that growth adds to a single call: a new block or chunk,
+    // and a block and the map of the deque that indexes them
+    constexpr size_t growth = 3;
+
+    const auto check = [&](const char *function, unsigned int kind, double limit,
+                            size_t bound, allocation_counts measured) {
+        const bool ok = measured.mean <= limit && measured.max <= bound;
+
+        std::printf("%-6s %-20s %-8s %.3f allocations per call (at most %zu), "
+                    "limit %.3f (at most %zu)\n",
+                    ok ? "ok" : "FAILED", function, kind_name(kind), measured.mean,
+                    measured.max, limit, bound);
+        failed += !ok;
+    };
+
+    for (unsigned int kind : kinds) {
+        const unsigned long id = strqueue_new_ex(kind);
+        const unsigned long copy = strqueue_new_ex(kind);
+        strqueue_push_back_n(id, strs.data(), strs.size());
+        strqueue_push_back_n(copy, strs.data(), strs.size());
+
+        check("strqueue_get_at", kind, 0, 0, count_allocations([&](size_t i) {
+            strqueue_get_at(id, i % 1024);
+        }));
+
+        check("strqueue_view_at", kind, 0, 0, count_allocations([&](size_t i) {
+            strqueue_view view;
+            strqueue_view_at(id, i % 1024, &view);
+        }));
+
+        check("strqueue_size", kind, 0, 0, count_allocations([&](size_t) {
+            strqueue_size(id);
+        }));
+
+        check("strqueue_find", kind, 0, 0, count_allocations([&](size_t i) {
+            strqueue_find(id, str.c_str(), i % 1024);
+        }));
+
+        check("strqueue_contains", kind, 0, 0, count_allocations([&](size_t) {
+            strqueue_contains(id, other.c_str());
+        }));
+
+        check("strqueue_comp", kind, 0, 0, count_allocations([&](size_t) {
+            strqueue_comp(id, copy);
+        }));
+
+        // lookups in the index of an indexed queue
+        strqueue_set_indexed(id, 1);
+
+        check("strqueue_contains", kind, 0, 0, count_allocations([&](size_t i) {
+            strqueue_contains(id, i % 2 ? str.c_str() : other.c_str());
+        }));
+
+        strqueue_set_indexed(id, 0);
+
+        // the string, a tree node apart from it, and now and then a
+        // new block of the container
+        const size_t per_insertion = kind == STRQUEUE_TREE ? 2 : 1;
+
+        const allocation_counts inserted = count_allocations([&](size_t i) {
+            strqueue_insert_at(id, 1024 + i, other.c_str());
+        });
+
+        check("strqueue_insert_at", kind, per_insertion + 0.125, per_insertion + growth,
+                inserted);
+
+        // arena queues compact their strings now and then
+        check("strqueue_remove_at", kind, 1.0 / 64, growth, count_allocations([&](size_t) {
+            strqueue_remove_at(id, 1024);
+        }));
+
+        strqueue_delete(copy);
+        strqueue_delete(id);
+    }
+
+    return failed;
+}
+
+int usage(const char *program) {
+    std::fprintf(stderr, "usage: %s [--repeat n] trace | --check-allocations\n", program);
+    return 2;
+}
+
+} // namespace
+
+// replays a trace written by a traced build, '-' reading it from stdin,
+// or checks the allocations of the strqueue functions
+int main(int argc, char **argv) {
+    size_t repeat = 1;
+    int arg = 1;
+
+    strqueue_set_tracing(0);
+
+    if (argc == 2 && std::strcmp(argv[1], "--check-allocations") == 0)
+        return check_allocations() == 0 ? 0 : 1;
+
+    if (argc == 4 && std::strcmp(argv[1], "--repeat") == 0) {
+        repeat = std::strtoul(argv[2], NULL, 10);
+        arg = 3;
+    }
+
+    if (arg != argc - 1 || repeat == 0)
+        return usage(argv[0]);
+
+    if (std::strcmp(argv[arg], "-") == 0)
+        return replay(std::cin, repeat) == 0 ? 0 : 1;
+
+    std::ifstream in(argv[arg], std::ios::binary);
+
+    if (!in) {
+        std::perror(argv[arg]);
+        return 1;
+    }
+
+    return replay(in, repeat) == 0 ? 0 : 1;
+}
@@ -1,324 +1,7192 @@
 #include <string>
 #include <unordered_map>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <utility>
 #include <deque>
+#include <memory>
+#include <string_view>
+#include <optional>
+#include <charconv>
+#include <vector>
 #include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
 
+#ifdef STRQUEUE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#include <unistd.h>
+#define STRQUEUE_HAS_MMAP
+#endif
+
+#ifdef STRQUEUE_NUMA
+#ifndef __linux__
+#error "STRQUEUE_NUMA needs Linux"
+#endif
+#include <sys/syscall.h>
+#endif
+
 #include "strqueue.h"
 
+// tracing code is compiled in for debug builds and for release builds
+// defining STRQUEUE_TRACE, STRQUEUE_NO_TRACE removes it altogether;
+// whether it actually runs is decided at runtime, see tracing()
+#if defined(STRQUEUE_NO_TRACE) || (defined(NDEBUG) && !defined(STRQUEUE_TRACE))
+static constexpr bool trace_compiled = false;
+#else
+static constexpr bool trace_compiled = true;
+#endif
+
+// whether tracing is on when the STRQUEUE_TRACE variable is not set
 #ifdef NDEBUG
-static constexpr bool debug = false;
+static constexpr bool trace_default = false;
 #else
-static constexpr bool debug = true;
+static constexpr bool trace_default = true;
 #endif
 
 
-using std::cerr;
-using std::unordered_map;
-using std::deque;
-using std::string;
-using std::to_string;
-using std::is_null_pointer;
-using std::is_integral;
-using std::is_same;
-using std::numeric_limits;
+using std::unordered_map;
+using std::deque;
+using std::string;
+using std::string_view;
+using std::vector;
+using std::unique_ptr;
+using std::make_unique;
+using std::move;
+using std::array;
+using std::pair;
+using std::optional;
+using std::less;
+using std::atomic;
+using std::shared_mutex;
+using std::shared_ptr;
+using std::unique_lock;
+using std::shared_lock;
+using std::lock_guard;
+using std::memory_order_relaxed;
+using std::memory_order_acquire;
+using std::memory_order_release;
+using std::memory_order_acq_rel;
+using std::memory_order_seq_cst;
+using std::atomic_signal_fence;
+using std::atomic_thread_fence;
+using std::to_chars;
+using std::from_chars;
+using std::is_null_pointer;
+using std::is_integral;
+using std::is_same;
+using std::conditional_t;
+using std::numeric_limits;
+
+
+namespace {
+
+// whether p is the only owner of its object; the fence then orders
+// the reads of owners that have let go of it before what follows
+template<typename T>
+bool unshared(const shared_ptr<T> &p) {
+    if (p.use_count() != 1)
+        return false;
+
+    atomic_thread_fence(memory_order_acquire);
+    return true;
+}
+
+// defined with the comparison kernels further down
+bool equal_strings(string_view s1, string_view s2);
+
+// sequence of strings backing a single queue; views returned by at()
+// stay valid until the next modification and are NUL-terminated
+class storage {
+public:
+    virtual ~storage() = default;
+
+    virtual size_t size(void) const = 0;
+
+    virtual string_view at(size_t position) const = 0;
+
+    // the modifying functions return false, leaving the elements
+    // unchanged, if the backend cannot store the change; only persistent
+    // storage, which writes to files, ever does
+
+    // position must not exceed size()
+    virtual bool insert(size_t position, string_view str) = 0;
+
+    // same as above, takes over the string instead of copying it if possible
+    virtual bool insert_moved(size_t position, string &&str) {
+        return insert(position, string_view(str));
+    }
+
+    // position must be smaller than size()
+    virtual bool erase(size_t position) = 0;
+
+    virtual bool clear(void) = 0;
+
+    // inserts n strings before position; this and erase_range
+    // are overridden by backends that can fail
+    virtual bool insert_range(size_t position, const string_view *strs, size_t n) {
+        for (size_t i = 0; i < n; ++i)
+            insert(position + i, strs[i]);
+        return true;
+    }
+
+    // removes count strings starting at position, all of them must exist
+    virtual bool erase_range(size_t position, size_t count) {
+        while (count-- > 0)
+            erase(position);
+        return true;
+    }
+
+    // stores pointers to count strings starting at position in out
+    virtual void get_range(size_t position, size_t count, const char **out) const {
+        for (size_t i = 0; i < count; ++i)
+            out[i] = at(position + i).data();
+    }
+
+    // same as above, with the lengths
+    virtual void get_views(size_t position, size_t count, string_view *out) const {
+        for (size_t i = 0; i < count; ++i)
+            out[i] = at(position + i);
+    }
+
+    // position of the first element equal to str at or after start,
+    // STRQUEUE_NOT_FOUND if there is none
+    virtual size_t find(string_view str, size_t start) const;
+
+    // makes room for count more strings taking up bytes in total, as far
+    // as the backend can preallocate them
+    virtual void reserve(size_t, size_t) {}
+
+    // frees memory kept for elements that are not there
+    virtual void shrink_to_fit(void) {}
+
+    // replaces the elements with n strings
+    virtual void assign(const string_view *strs, size_t n) {
+        clear();
+        for (size_t i = 0; i < n; ++i)
+            insert(i, strs[i]);
+    }
+
+    // flags for make_storage giving an empty storage of the same kind,
+    // none for storage that elements cannot be moved out of
+    virtual optional<unsigned int> kind(void) const {
+        return std::nullopt;
+    }
+
+    // storage with the same elements that can be modified independently;
+    // backends share their elements with the clone where they can and
+    // copy only what is modified later, the default copies everything
+    virtual unique_ptr<storage> clone(void) const;
+
+    // the object holding the elements that clones share until either
+    // is modified, nullptr if there is none
+    virtual const void *shared_elements(void) const {
+        return nullptr;
+    }
+
+    // whether both hold the very same elements, as a queue and its
+    // unmodified clone do; false does not mean that they differ
+    bool same_as(const storage &other) const {
+        const void *elements = shared_elements();
+
+        return elements != nullptr && elements == other.shared_elements();
+    }
+
+    // content hash and total length of the elements kept with them
+    // by persistent backends, false if there is no hash matching them;
+    // the kept hash is dropped once loaded, so that it cannot be matched
+    // against elements changed after that, until save_hash stores a new one
+    virtual bool load_summary(uint64_t &, size_t &) {
+        return false;
+    }
+
+    virtual void save_hash(uint64_t) {}
+};
+
+// default backend: O(1) access and O(1) insertion at both ends,
+// but middle insertions and removals shift O(n) elements; the strings
+// are kept in chunks of chunk_size, which clones share, so the first
+// modification after a clone copies only the table of chunks and the
+// chunks it changes
+class deque_storage final : public storage {
+public:
+    deque_storage(void) : state(std::make_shared<contents>()) {}
+
+    size_t size(void) const override {
+        return state->count;
+    }
+
+    string_view at(size_t position) const override {
+        const size_t index = state->first + position;
+
+        return (*state->chunks[index / chunk_size])[index % chunk_size];
+    }
+
+    bool insert(size_t position, string_view str) override {
+        if (position == size()) {
+            // nothing is moved, so str may point into the elements
+            grow_back(1);
+            slot(position).assign(str.data(), str.size());
+            return true;
+        }
+        return insert_moved(position, string(str));
+    }
+
+    bool insert_moved(size_t position, string &&str) override {
+        open_gap(position, 1);
+        slot(position) = move(str);
+        return true;
+    }
+
+    bool erase(size_t position) override {
+        return erase_range(position, 1);
+    }
+
+    bool clear(void) override {
+        // shared contents are left to the clones instead of being copied
+        if (unshared(state)) {
+            state->chunks.clear();
+            state->first = 0;
+            state->count = 0;
+        } else {
+            state = std::make_shared<contents>();
+        }
+        return true;
+    }
+
+    bool insert_range(size_t position, const string_view *strs, size_t n) override {
+        // an empty gap would move every string onto itself
+        if (n == 0)
+            return true;
+
+        if (position == size()) {
+            grow_back(n);
+            own(position, position + n);
+            for (size_t i = 0; i < n; ++i)
+                element(position + i).assign(strs[i].data(), strs[i].size());
+            return true;
+        }
+
+        // strs may point into the elements that open_gap moves
+        vector<string> copies(strs, strs + n);
+
+        open_gap(position, n);
+        own(position, position + n);
+        for (size_t i = 0; i < n; ++i)
+            element(position + i) = move(copies[i]);
+        return true;
+    }
+
+    bool erase_range(size_t position, size_t count) override {
+        if (count == 0)
+            return true;
+
+        const size_t after = size() - position - count;
+
+        // the shorter side is moved over the erased strings
+        if (position < after) {
+            own(0, position + count);
+            for (size_t i = position; i-- > 0;)
+                element(i + count) = move(element(i));
+            shrink_front(count);
+        } else {
+            own(position, size());
+            for (size_t i = position; i < position + after; ++i)
+                element(i) = move(element(i + count));
+            shrink_back(count);
+        }
+        return true;
+    }
+
+    // chunks are allocated one by one and every string separately,
+    // so there is nothing to reserve
+    void shrink_to_fit(void) override {
+        // shared contents are not copied just to be shrunk
+        if (!unshared(state))
+            return;
+
+        auto &s = *state;
+
+        while (s.first >= chunk_size) {
+            s.chunks.pop_front();
+            s.first -= chunk_size;
+        }
+        while (s.chunks.size() * chunk_size >= s.first + s.count + chunk_size)
+            s.chunks.pop_back();
+        s.chunks.shrink_to_fit();
+    }
+
+    size_t find(string_view str, size_t start) const override {
+        for (size_t i = start; i < size(); ++i)
+            if (equal_strings(at(i), str))
+                return i;
+        return STRQUEUE_NOT_FOUND;
+    }
+
+    void assign(const string_view *strs, size_t n) override {
+        // the old contents are kept until the end, strs may point into them
+        const auto old = move(state);
+
+        state = std::make_shared<contents>();
+        insert_range(0, strs, n);
+    }
+
+    optional<unsigned int> kind(void) const override {
+        return STRQUEUE_DEQUE;
+    }
+
+    unique_ptr<storage> clone(void) const override {
+        return unique_ptr<storage>(new deque_storage(state));
+    }
+
+    const void *shared_elements(void) const override {
+        return state.get();
+    }
+
+private:
+    static constexpr size_t chunk_size = 32;
+
+    using chunk = array<string, chunk_size>;
+
+    // chunks.front() holds the first string at index first; up to one
+    // empty chunk is kept past each end, so that a queue which grows and
+    // shrinks at an end does not allocate a chunk every time
+    struct contents {
+        deque<shared_ptr<chunk>> chunks;
+        size_t first = 0;
+        size_t count = 0;
+    };
+
+    shared_ptr<contents> state;
+
+    explicit deque_storage(shared_ptr<contents> shared) : state(move(shared)) {}
+
+    // the contents, with the table of chunks copied first if a clone
+    // shares it; the chunks themselves stay shared
+    contents &writable(void) {
+        if (!unshared(state))
+            state = std::make_shared<contents>(*state);
+
+        return *state;
+    }
+
+    // copies the chunks holding the strings in [from, to) that a clone
+    // shares, so that element can change them
+    void own(size_t from, size_t to) {
+        auto &s = writable();
+
+        if (from == to)
+            return;
+
+        for (size_t i = (s.first + from) / chunk_size; i <= (s.first + to - 1) / chunk_size; ++i)
+            if (!unshared(s.chunks[i]))
+                s.chunks[i] = std::make_shared<chunk>(*s.chunks[i]);
+    }
+
+    // string at position, which own must have been called for
+    string &element(size_t position) {
+        const size_t index = state->first + position;
+
+        return (*state->chunks[index / chunk_size])[index % chunk_size];
+    }
+
+    string &slot(size_t position) {
+        own(position, position + 1);
+        return element(position);
+    }
+
+    // adds n empty strings at the front
+    void grow_front(size_t n) {
+        auto &s = writable();
+
+        while (s.first < n) {
+            s.chunks.push_front(std::make_shared<chunk>());
+            s.first += chunk_size;
+        }
+        s.first -= n;
+        s.count += n;
+    }
+
+    // adds n empty strings at the back
+    void grow_back(size_t n) {
+        auto &s = writable();
+
+        s.count += n;
+        while (s.chunks.size() * chunk_size < s.first + s.count)
+            s.chunks.push_back(std::make_shared<chunk>());
+    }
+
+    // makes room for n strings at position, moving the shorter side
+    void open_gap(size_t position, size_t n) {
+        const size_t after = size() - position;
+
+        if (position < after) {
+            grow_front(n);
+            own(0, position + n);
+            for (size_t i = 0; i < position; ++i)
+                element(i) = move(element(i + n));
+        } else {
+            grow_back(n);
+            own(position, size());
+            for (size_t i = size() - 1; i >= position + n; --i)
+                element(i) = move(element(i - n));
+        }
+    }
+
+    // empties the strings at indices [from, to) of the chunks, except
+    // in the chunks a clone shares, which keeps them anyway
+    void release(size_t from, size_t to) {
+        auto &s = *state;
+
+        while (from < to) {
+            auto &c = s.chunks[from / chunk_size];
+            const size_t end = std::min(to, (from / chunk_size + 1) * chunk_size);
+
+            if (unshared(c))
+                for (size_t i = from; i < end; ++i)
+                    string().swap((*c)[i % chunk_size]);
+            from = end;
+        }
+    }
+
+    // drops the first n strings
+    void shrink_front(size_t n) {
+        auto &s = writable();
+
+        release(s.first, s.first + n);
+        s.first += n;
+        s.count -= n;
+        while (s.first >= 2 * chunk_size) {
+            s.chunks.pop_front();
+            s.first -= chunk_size;
+        }
+    }
+
+    // drops the last n strings
+    void shrink_back(size_t n) {
+        auto &s = writable();
+
+        s.count -= n;
+
+        const size_t end = s.first + s.count;
+
+        release(end, end + n);
+        while (s.chunks.size() * chunk_size >= end + 2 * chunk_size)
+            s.chunks.pop_back();
+    }
+};
+
+// implicit-key treap with subtree sizes: O(log n) expected time
+// for positional access, insertion and removal anywhere in the queue;
+// nodes are reference counted and clones share them, a modification
+// copies only the shared nodes on its path
+class tree_storage final : public storage {
+public:
+    tree_storage(void) = default;
+
+    tree_storage(const tree_storage &) = delete;
+
+    tree_storage &operator=(const tree_storage &) = delete;
+
+    ~tree_storage(void) override {
+        release(root);
+    }
+
+    size_t size(void) const override {
+        return count(root);
+    }
+
+    string_view at(size_t position) const override {
+        const node *t = root;
+
+        while (count(t->left) != position) {
+            if (position < count(t->left)) {
+                t = t->left;
+            }
+            else {
+                position -= count(t->left) + 1;
+                t = t->right;
+            }
+        }
+
+        return t->value;
+    }
+
+    bool insert(size_t position, string_view str) override {
+        node *left, *right;
+
+        split(root, position, left, right);
+        root = merge(merge(left, new node(str, next_priority())), right);
+        return true;
+    }
+
+    bool insert_moved(size_t position, string &&str) override {
+        node *left, *right;
+
+        split(root, position, left, right);
+        root = merge(merge(left, new node(move(str), next_priority())), right);
+        return true;
+    }
+
+    bool erase(size_t position) override {
+        erase(root, position);
+        return true;
+    }
+
+    bool clear(void) override {
+        release(root);
+        root = nullptr;
+        return true;
+    }
+
+    bool insert_range(size_t position, const string_view *strs, size_t n) override {
+        node *left, *right;
+
+        split(root, position, left, right);
+        root = merge(merge(left, build(n, [&](size_t i) { return strs[i]; })),
+                        right);
+        return true;
+    }
+
+    void assign(const string_view *strs, size_t n) override {
+        clear();
+        root = build(n, [&](size_t i) { return strs[i]; });
+    }
+
+    optional<unsigned int> kind(void) const override {
+        return STRQUEUE_TREE;
+    }
+
+    bool erase_range(size_t position, size_t count) override {
+        node *left, *middle, *right;
+
+        split(root, position, left, middle);
+        split(middle, count, middle, right);
+        release(middle);
+        root = merge(left, right);
+        return true;
+    }
+
+    void get_range(size_t position, size_t count, const char **out) const override {
+        collect(root, position, count, out);
+    }
+
+    void get_views(size_t position, size_t count, string_view *out) const override {
+        collect(root, position, count, out);
+    }
+
+    size_t find(string_view str, size_t start) const override {
+        return find_from(root, start, str);
+    }
+
+    unique_ptr<storage> clone(void) const override {
+        auto res = make_unique<tree_storage>();
+
+        res->root = retain(root);
+        res->seed = seed;
+        return res;
+    }
+
+    const void *shared_elements(void) const override {
+        return root;
+    }
+
+private:
+    struct node {
+        string value;
+        size_t count = 1;
+        uint32_t priority;
+        // number of parents and trees pointing to the node
+        atomic<uint32_t> refs{1};
+        node *left = nullptr, *right = nullptr;
+
+        node(string_view str, uint32_t prio) : value(str), priority(prio) {}
+
+        node(string &&str, uint32_t prio) : value(move(str)), priority(prio) {}
+
+        // a copy with the same children, which gain a parent
+        explicit node(const node &other)
+            : value(other.value), count(other.count), priority(other.priority),
+              left(retain(other.left)), right(retain(other.right)) {}
+    };
+
+    node *root = nullptr;
+    uint32_t seed = 0x9e3779b9u;
+
+    // xorshift32, good enough for balancing purposes
+    uint32_t next_priority(void) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    static size_t count(const node *t) {
+        return t == nullptr ? 0 : t->count;
+    }
+
+    static void update(node *t) {
+        t->count = 1 + count(t->left) + count(t->right);
+    }
+
+    static node *retain(node *t) {
+        if (t != nullptr)
+            t->refs.fetch_add(1, memory_order_relaxed);
+        return t;
+    }
+
+    // drops a reference to t, freeing the nodes no longer referenced
+    static void release(node *t) {
+        if (t == nullptr || t->refs.fetch_sub(1, memory_order_acq_rel) != 1)
+            return;
+
+        release(t->left);
+        release(t->right);
+        delete t;
+    }
+
+    // t if no other tree shares it, otherwise a copy of t taking
+    // its place, so that the result can be modified; every function
+    // changing nodes calls it on the way down from the root
+    static node *own(node *t) {
+        if (t->refs.load(memory_order_acquire) == 1)
+            return t;
+
+        node *copy = new node(*t);
+        release(t);
+        return copy;
+    }
+
+    // splits t into its first k elements and the remaining ones
+    static void split(node *t, size_t k, node *&left, node *&right) {
+        if (t == nullptr) {
+            left = right = nullptr;
+            return;
+        }
+
+        t = own(t);
+
+        if (count(t->left) < k) {
+            split(t->right, k - count(t->left) - 1, t->right, right);
+            left = t;
+        }
+        else {
+            split(t->left, k, left, t->left);
+            right = t;
+        }
+
+        update(t);
+    }
+
+    // concatenates two trees, every element of left precedes right
+    static node *merge(node *left, node *right) {
+        if (left == nullptr)
+            return right;
+        if (right == nullptr)
+            return left;
+
+        if (left->priority > right->priority) {
+            left = own(left);
+            left->right = merge(left->right, right);
+            update(left);
+            return left;
+        }
+
+        right = own(right);
+        right->left = merge(left, right->left);
+        update(right);
+        return right;
+    }
+
+    // builds a treap of n strings returned by str_at in linear time,
+    // keeping the right spine of the tree built so far on a stack
+    template<typename StrAt>
+    node *build(size_t n, StrAt str_at) {
+        vector<node*> spine;
+
+        for (size_t i = 0; i < n; ++i) {
+            node *t = new node(str_at(i), next_priority());
+            node *last = nullptr;
+
+            while (!spine.empty() && spine.back()->priority < t->priority) {
+                last = spine.back();
+                spine.pop_back();
+            }
+
+            t->left = last;
+            if (!spine.empty())
+                spine.back()->right = t;
+            spine.push_back(t);
+        }
+
+        if (spine.empty())
+            return nullptr;
+
+        fix_counts(spine.front());
+        return spine.front();
+    }
+
+    static size_t fix_counts(node *t) {
+        if (t == nullptr)
+            return 0;
+
+        t->count = 1 + fix_counts(t->left) + fix_counts(t->right);
+        return t->count;
+    }
+
+    // in-order walk from position on, the result is counted from
+    // the first element of t
+    static size_t find_from(const node *t, size_t position, string_view str) {
+        if (t == nullptr || position >= t->count)
+            return STRQUEUE_NOT_FOUND;
+
+        const size_t left_count = count(t->left);
+
+        if (position < left_count) {
+            const size_t res = find_from(t->left, position, str);
+
+            if (res != STRQUEUE_NOT_FOUND)
+                return res;
+        }
+
+        if (position <= left_count && equal_strings(t->value, str))
+            return left_count;
+
+        const size_t skip = position > left_count ? position - left_count - 1 : 0;
+        const size_t res = find_from(t->right, skip, str);
+
+        return res == STRQUEUE_NOT_FOUND ? res : left_count + 1 + res;
+    }
+
+    static void put(const char *&out, const string &str) {
+        out = str.c_str();
+    }
+
+    static void put(string_view &out, const string &str) {
+        out = str;
+    }
+
+    // in-order walk over count elements starting at position,
+    // returns the number of elements that still have to be stored
+    template<typename T>
+    static size_t collect(const node *t, size_t position, size_t remaining, T *&out) {
+        if (t == nullptr || remaining == 0)
+            return remaining;
+
+        const size_t left_count = count(t->left);
+
+        if (position < left_count)
+            remaining = collect(t->left, position, remaining, out);
+
+        if (remaining > 0 && position <= left_count) {
+            put(*out++, t->value);
+            --remaining;
+        }
+
+        if (remaining > 0) {
+            const size_t skip = position > left_count ? position - left_count - 1 : 0;
+            remaining = collect(t->right, skip, remaining, out);
+        }
+
+        return remaining;
+    }
+
+    static void erase(node *&t, size_t position) {
+        if (position == count(t->left)) {
+            node *old = t, *left = t->left, *right = t->right;
+
+            // a node still shared keeps its children, which gain a parent
+            if (old->refs.load(memory_order_acquire) == 1) {
+                old->left = old->right = nullptr;
+            }
+            else {
+                retain(left);
+                retain(right);
+            }
+
+            release(old);
+            t = merge(left, right);
+            return;
+        }
+
+        t = own(t);
+
+        if (position < count(t->left))
+            erase(t->left, position);
+        else
+            erase(t->right, position - count(t->left) - 1);
+
+        --t->count;
+    }
+};
+
+// node of arenas whose chunks are placed wherever they are first touched
+constexpr int any_node = -1;
+
+// flags of make_storage above the kind hold one more than the node the
+// strings of arena queues are placed on, 0 for any_node
+constexpr unsigned int node_shift = 8;
+
+constexpr unsigned int node_flags(int node) {
+    return static_cast<unsigned int>(node + 1) << node_shift;
+}
+
+constexpr int node_of(unsigned int flags) {
+    return static_cast<int>(flags >> node_shift) - 1;
+}
+
+#ifdef STRQUEUE_NUMA
+// number of NUMA nodes, one more than the last in the kernel's list of
+// possible ones such as "0-1"; 1 if it cannot be read
+size_t node_count(void) {
+    static const size_t count = [] {
+        size_t res = 1;
+        FILE *list = fopen("/sys/devices/system/node/possible", "r");
+
+        if (list == NULL)
+            return res;
+
+        char text[256];
+        const size_t length = fread(text, 1, sizeof(text) - 1, list);
+        fclose(list);
+
+        size_t end = length;
+        while (end > 0 && (text[end - 1] < '0' || text[end - 1] > '9'))
+            --end;
+        size_t start = end;
+        while (start > 0 && text[start - 1] >= '0' && text[start - 1] <= '9')
+            --start;
+
+        size_t last;
+        if (start < end && from_chars(text + start, text + end, last).ec == std::errc())
+            res = last + 1;
+
+        return res;
+    }();
+
+    return count;
+}
+
+// node of the CPU the calling thread runs on
+int current_node(void) {
+    unsigned int cpu, node;
+    return syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 ? static_cast<int>(node) : 0;
+}
+#endif
+
+// frees arena chunks, which are mapped directly when placed on a node
+struct chunk_deleter {
+    // length of the mapping, 0 for chunks from new
+    size_t mapped = 0;
+
+    void operator()(char *chunk) const {
+#ifdef STRQUEUE_NUMA
+        if (mapped != 0) {
+            munmap(chunk, mapped);
+            return;
+        }
+#endif
+        delete[] chunk;
+    }
+};
+
+using chunk_ptr = unique_ptr<char[], chunk_deleter>;
+
+// bytes for an arena chunk, from the pages of node in STRQUEUE_NUMA builds
+chunk_ptr allocate_chunk(size_t bytes, int node) {
+#ifdef STRQUEUE_NUMA
+    constexpr size_t mask_bits = 8 * sizeof(unsigned long);
+    // MPOL_PREFERRED, which falls back to other nodes once node is full
+    constexpr int preferred = 1;
+    unsigned long mask[16] = {};
+
+    if (node != any_node && static_cast<size_t>(node) < std::size(mask) * mask_bits) {
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const size_t length = (bytes + page - 1) / page * page;
+        void *chunk = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (chunk != MAP_FAILED) {
+            mask[node / mask_bits] = 1ul << node % mask_bits;
+            // if this fails the pages are placed when first touched
+            syscall(SYS_mbind, chunk, length, preferred, mask, std::size(mask) * mask_bits + 1, 0);
+
+            return chunk_ptr(static_cast<char*>(chunk), chunk_deleter{length});
+        }
+    }
+#else
+    (void)node;
+#endif
+
+    return chunk_ptr(new char[bytes]);
+}
+
+// bump allocator handing out string bytes from large chunks,
+// which are only ever released all at once
+class arena {
+public:
+    // chunks are taken from the pages of node, see allocate_chunk
+    explicit arena(int home = any_node) : node(home) {}
+
+    int home_node(void) const {
+        return node;
+    }
+
+    // copies str followed by a NUL into the arena
+    const char *store(string_view str) {
+        const size_t needed = str.size() + 1;
+
+        if (needed > left) {
+            // big strings get a chunk of their own, so that the
+            // current chunk is not abandoned half-empty
+            if (needed > max_chunk / 2)
+                return copy_to(allocate(needed, false), str);
+
+            allocate(needed, true);
+        }
+
+        char *res = copy_to(next, str);
+        next += needed;
+        left -= needed;
+        used += needed;
+
+        return res;
+    }
+
+    // number of bytes handed out since the last reset
+    size_t size(void) const {
+        return used;
+    }
+
+    // bytes of all chunks
+    size_t capacity(void) const {
+        return allocated;
+    }
+
+    // makes the current chunk hold at least bytes more, so that storing
+    // them allocates nothing; what is left of the previous one is lost
+    void reserve(size_t bytes) {
+        if (bytes <= left)
+            return;
+
+        chunks.push_back(allocate_chunk(bytes, node));
+        current_chunk = chunks.size() - 1;
+        next = chunks.back().get();
+        left = current_size = bytes;
+        allocated += bytes;
+    }
+
+    // releases every chunk, keeping only the current one for reuse
+    void reset(void) {
+        if (chunks.empty())
+            return;
+
+        auto &current = chunks[current_chunk];
+        if (current_chunk != 0)
+            chunks.front().swap(current);
+        chunks.resize(1);
+        current_chunk = 0;
+
+        next = chunks.front().get();
+        left = allocated = current_size;
+        used = 0;
+    }
+
+    void swap(arena &other) {
+        chunks.swap(other.chunks);
+        std::swap(current_chunk, other.current_chunk);
+        std::swap(next, other.next);
+        std::swap(left, other.left);
+        std::swap(used, other.used);
+        std::swap(chunk_size, other.chunk_size);
+        std::swap(current_size, other.current_size);
+        std::swap(allocated, other.allocated);
+        std::swap(node, other.node);
+    }
+
+private:
+    static constexpr size_t min_chunk = 1 << 12;
+    static constexpr size_t max_chunk = 1 << 20;
+
+    vector<chunk_ptr> chunks;
+    // index of the chunk that strings are currently bump-allocated from
+    size_t current_chunk = 0;
+    char *next = nullptr;
+    size_t left = 0;
+    size_t used = 0;
+    // size of the last chunk, doubles with every new one
+    size_t chunk_size = min_chunk / 2;
+    // size of the current chunk, different if it was reserved
+    size_t current_size = 0;
+    size_t allocated = 0;
+    int node;
+
+    char *copy_to(char *dest, string_view str) {
+        memcpy(dest, str.data(), str.size());
+        dest[str.size()] = '\0';
+        return dest;
+    }
+
+    char *allocate(size_t bytes, bool bump) {
+        if (!bump) {
+            chunks.push_back(allocate_chunk(bytes, node));
+            used += bytes;
+            allocated += bytes;
+            return chunks.back().get();
+        }
+
+        if (chunk_size < max_chunk)
+            chunk_size *= 2;
+
+        chunks.push_back(allocate_chunk(chunk_size, node));
+        current_chunk = chunks.size() - 1;
+        next = chunks.back().get();
+        left = current_size = chunk_size;
+        allocated += chunk_size;
+
+        return next;
+    }
+};
+
+// strings live in a per-queue arena and the sequence holds only compact
+// (pointer, length) handles: one allocation per many strings, and clear
+// or delete frees everything in bulk; bytes of removed strings are
+// reclaimed by compaction once they outweigh the live ones; clones
+// share everything until either of them is modified
+class arena_storage final : public storage {
+public:
+    // strings are stored in chunks placed on node
+    explicit arena_storage(int node = any_node) : state(fresh_contents(node)) {}
+
+    size_t size(void) const override {
+        return state->handles.size();
+    }
+
+    string_view at(size_t position) const override {
+        const handle &h = state->handles[position];
+        return string_view(h.data, h.length);
+    }
+
+    bool insert(size_t position, string_view str) override {
+        if (!storable(str))
+            return false;
+
+        auto &[handles, bytes, live] = writable();
+        const handle h{bytes.store(str), static_cast<uint32_t>(str.size())};
+
+        if (position == handles.size())
+            handles.push_back(h);
+        else
+            handles.insert(handles.begin() + position, h);
+
+        live += str.size() + 1;
+        return true;
+    }
+
+    bool erase(size_t position) override {
+        return erase_range(position, 1);
+    }
+
+    bool clear(void) override {
+        // shared contents are left to the clones instead of being copied
+        if (!unshared(state)) {
+            state = fresh_contents(state->bytes.home_node());
+            return true;
+        }
+
+        state->handles.clear();
+        state->bytes.reset();
+        state->live = 0;
+        return true;
+    }
+
+    bool insert_range(size_t position, const string_view *strs, size_t n) override {
+        // libstdc++ corrupts a deque on an empty insertion into its front half
+        if (n == 0)
+            return true;
+
+        for (size_t i = 0; i < n; ++i)
+            if (!storable(strs[i]))
+                return false;
+
+        auto &[handles, bytes, live] = writable();
+        auto first = handles.insert(handles.begin() + position, n, handle{nullptr, 0});
+
+        for (size_t i = 0; i < n; ++i, ++first) {
+            const string_view str = strs[i];
+
+            *first = handle{bytes.store(str), static_cast<uint32_t>(str.size())};
+            live += str.size() + 1;
+        }
+        return true;
+    }
+
+    bool erase_range(size_t position, size_t count) override {
+        auto &[handles, bytes, live] = writable();
+        const auto first = handles.begin() + position;
+
+        for (auto it = first; it != first + count; ++it)
+            live -= it->length + 1;
+        handles.erase(first, first + count);
+
+        if (bytes.size() - live > compaction_threshold && bytes.size() > 2 * live)
+            compact(*state);
+        return true;
+    }
+
+    size_t find(string_view str, size_t start) const override {
+        const auto &handles = state->handles;
+
+        // lengths rule out most elements without touching their bytes
+        for (size_t i = start; i < handles.size(); ++i)
+            if (handles[i].length == str.size()
+                    && equal_strings(string_view(handles[i].data, handles[i].length), str))
+                return i;
+
+        return STRQUEUE_NOT_FOUND;
+    }
+
+    // strs come from a queue of this kind or from 32-bit lengths in
+    // a snapshot or a compressed block, so all of them are storable
+    void assign(const string_view *strs, size_t n) override {
+        clear();
+
+        auto &[handles, bytes, live] = *state;
+
+        handles.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            assert(storable(strs[i]));
+            handles[i] = handle{bytes.store(strs[i]), static_cast<uint32_t>(strs[i].size())};
+            live += strs[i].size() + 1;
+        }
+    }
+
+    // the handles are in a deque, only the bytes can be reserved
+    void reserve(size_t, size_t bytes_needed) override {
+        // with the NULs, which are included in bytes_needed by the caller
+        writable().bytes.reserve(bytes_needed);
+    }
+
+    // everything is moved to a single chunk holding just the live strings
+    void shrink_to_fit(void) override {
+        auto &c = writable();
+
+        if (c.bytes.capacity() > c.live)
+            compact(c);
+        c.handles.shrink_to_fit();
+    }
+
+    optional<unsigned int> kind(void) const override {
+        return STRQUEUE_ARENA | node_flags(state->bytes.home_node());
+    }
+
+    unique_ptr<storage> clone(void) const override {
+        return unique_ptr<storage>(new arena_storage(state));
+    }
+
+    const void *shared_elements(void) const override {
+        return state.get();
+    }
+
+private:
+    static constexpr size_t compaction_threshold = 1 << 16;
+
+    struct handle {
+        const char *data;
+        uint32_t length;
+    };
+
+    // handles hold 32-bit lengths
+    static bool storable(string_view str) {
+        return str.size() <= numeric_limits<uint32_t>::max();
+    }
+
+    struct contents {
+        deque<handle> handles;
+        arena bytes;
+        // bytes taken up by strings still in the queue
+        size_t live = 0;
+    };
+
+    shared_ptr<contents> state;
+
+    explicit arena_storage(shared_ptr<contents> shared) : state(move(shared)) {}
+
+    static shared_ptr<contents> fresh_contents(int node) {
+        auto res = std::make_shared<contents>();
+        res->bytes = arena(node);
+        return res;
+    }
+
+    // the contents, copied first if a clone shares them; the copy
+    // gets an arena of its own holding only the live strings
+    contents &writable(void) {
+        if (!unshared(state)) {
+            auto copy = fresh_contents(state->bytes.home_node());
+
+            copy->handles = state->handles;
+            copy->live = state->live;
+            compact(*copy);
+            state = move(copy);
+        }
+
+        return *state;
+    }
+
+    // moves live strings to a fresh arena, dropping removed ones
+    static void compact(contents &c) {
+        arena fresh(c.bytes.home_node());
+
+        fresh.reserve(c.live);
+        for (auto &h : c.handles)
+            h.data = fresh.store(string_view(h.data, h.length));
+
+        c.bytes.swap(fresh);
+    }
+};
+
+// string in a cell of a FIFO ring: short ones are copied into the cell,
+// so that pushing them allocates nothing, longer ones are malloc'ed
+struct fifo_item {
+    static constexpr size_t inline_bytes = 40;
+
+    // NUL-terminated, nullptr for strings held in bytes
+    char *heap;
+    size_t length;
+    char bytes[inline_bytes];
+
+    // false if a long string cannot be allocated
+    bool store(string_view str) {
+        length = str.size();
+
+        if (length <= inline_bytes) {
+            heap = nullptr;
+            memcpy(bytes, str.data(), length);
+            return true;
+        }
+
+        heap = static_cast<char*>(malloc(length + 1));
+        if (heap == nullptr)
+            return false;
+
+        memcpy(heap, str.data(), length);
+        heap[length] = '\0';
+        return true;
+    }
+
+    // a NUL-terminated copy of the string in buf if it fits in size bytes,
+    // otherwise a malloc'ed one, nullptr if that cannot be allocated;
+    // the item is left empty
+    char *take(char *buf, size_t size) {
+        char *res = (length < size) ? buf : heap;
+
+        if (res == nullptr)
+            res = static_cast<char*>(malloc(length + 1));
+
+        if (res != nullptr && res != heap) {
+            memcpy(res, heap != nullptr ? heap : bytes, length);
+            res[length] = '\0';
+        }
+
+        if (res != heap)
+            free(heap);
+        heap = nullptr;
+        return res;
+    }
+
+    void release(void) {
+        free(heap);
+        heap = nullptr;
+    }
+};
+
+// lock-free bounded FIFO of strings, whose ownership passes from
+// the pushing to the popping thread
+class fifo_ring {
+public:
+    virtual ~fifo_ring() = default;
+
+    // returns false if the ring is full or str cannot be allocated
+    virtual bool push(string_view str) = 0;
+
+    // moves the oldest string to out, returns false if the ring is empty
+    virtual bool pop(fifo_item &out) = 0;
+
+    // exact only while no push or pop is in progress
+    virtual size_t size(void) const = 0;
+
+    // whether only one thread may pop, so that no other can drain the ring
+    virtual bool single_consumer(void) const = 0;
+
+    // frees the strings left, called by the rings' destructors
+    void drain(void) {
+        fifo_item item;
+
+        while (pop(item))
+            item.release();
+    }
+
+protected:
+    static size_t round_capacity(size_t capacity) {
+        size_t res = 2;
+
+        while (res < capacity)
+            res *= 2;
+
+        return res;
+    }
+};
+
+// one producer and one consumer thread, each owning one end of the ring
+// and keeping a cached copy of the other end to avoid cache misses
+class spsc_ring final : public fifo_ring {
+public:
+    explicit spsc_ring(size_t capacity)
+        : mask(round_capacity(capacity) - 1), slots(make_unique<fifo_item[]>(mask + 1)) {}
+
+    ~spsc_ring(void) override {
+        drain();
+    }
+
+    bool push(string_view str) override {
+        const size_t t = tail.load(memory_order_relaxed);
+
+        if (t - head_cache > mask) {
+            head_cache = head.load(memory_order_acquire);
+
+            if (t - head_cache > mask)
+                return false;
+        }
+
+        // the slot is the producer's until tail moves past it
+        if (!slots[t & mask].store(str))
+            return false;
+
+        tail.store(t + 1, memory_order_release);
+
+        return true;
+    }
+
+    bool pop(fifo_item &out) override {
+        const size_t h = head.load(memory_order_relaxed);
+
+        if (h == tail_cache) {
+            tail_cache = tail.load(memory_order_acquire);
+
+            if (h == tail_cache)
+                return false;
+        }
+
+        out = slots[h & mask];
+        head.store(h + 1, memory_order_release);
+
+        return true;
+    }
+
+    size_t size(void) const override {
+        return tail.load(memory_order_acquire) - head.load(memory_order_acquire);
+    }
+
+    bool single_consumer(void) const override {
+        return true;
+    }
+
+private:
+    const size_t mask;
+    const unique_ptr<fifo_item[]> slots;
+
+    // written by the consumer
+    alignas(64) atomic<size_t> head{0};
+    size_t tail_cache = 0;
+
+    // written by the producer
+    alignas(64) atomic<size_t> tail{0};
+    size_t head_cache = 0;
+};
+
+// any number of producers and consumers; every cell carries a sequence
+// number telling whose turn it is, so that a push or pop is a single
+// compare-and-swap on the shared position (Vyukov's bounded queue)
+class mpmc_ring final : public fifo_ring {
+public:
+    explicit mpmc_ring(size_t capacity)
+        : mask(round_capacity(capacity) - 1), cells(make_unique<cell[]>(mask + 1)) {
+        for (size_t i = 0; i <= mask; ++i)
+            cells[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    ~mpmc_ring(void) override {
+        drain();
+    }
+
+    bool push(string_view str) override {
+        // a long string is allocated before a cell is claimed,
+        // which cannot be given back
+        fifo_item item;
+
+        if (!item.store(str))
+            return false;
+
+        size_t pos = enqueue_pos.load(memory_order_relaxed);
+
+        for (;;) {
+            cell &c = cells[pos & mask];
+            const size_t seq = c.sequence.load(memory_order_acquire);
+            const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    c.item = item;
+                    c.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            }
+            // the cell still holds a string from the previous lap
+            else if (diff < 0) {
+                item.release();
+                return false;
+            }
+            else {
+                pos = enqueue_pos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(fifo_item &out) override {
+        size_t pos = dequeue_pos.load(memory_order_relaxed);
+
+        for (;;) {
+            cell &c = cells[pos & mask];
+            const size_t seq = c.sequence.load(memory_order_acquire);
+            const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    out = c.item;
+                    c.sequence.store(pos + mask + 1, memory_order_release);
+                    return true;
+                }
+            }
+            // the cell has not been filled yet
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = dequeue_pos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    size_t size(void) const override {
+        const size_t tail = enqueue_pos.load(memory_order_acquire);
+        const size_t head = dequeue_pos.load(memory_order_acquire);
+
+        return tail > head ? tail - head : 0;
+    }
+
+    bool single_consumer(void) const override {
+        return false;
+    }
+
+private:
+    struct cell {
+        atomic<size_t> sequence;
+        fifo_item item;
+    };
+
+    const size_t mask;
+    const unique_ptr<cell[]> cells;
+
+    alignas(64) atomic<size_t> enqueue_pos{0};
+    alignas(64) atomic<size_t> dequeue_pos{0};
+};
+
+#ifdef STRQUEUE_HAS_MMAP
+// a file mapped into memory in its entirety, grown on demand
+class mapped_file {
+public:
+    mapped_file(void) = default;
+
+    mapped_file(const mapped_file &) = delete;
+
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    ~mapped_file(void) {
+        close_file();
+    }
+
+    // maps the file at path, creating an empty one if asked to;
+    // exclusive also takes a lock keeping other processes out
+    bool open_file(const string &path, bool create, bool exclusive) {
+        fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if ((exclusive && flock(fd, LOCK_EX | LOCK_NB) != 0) || fstat(fd, &st) != 0) {
+            close_file();
+            return false;
+        }
+
+        return remap(static_cast<size_t>(st.st_size));
+    }
+
+    // makes sure the file holds at least size bytes, doubling its length
+    bool reserve(size_t size) {
+        if (size <= length)
+            return true;
+
+        size_t new_length = length < 4096 ? 4096 : length;
+        while (new_length < size)
+            new_length *= 2;
+
+        return ftruncate(fd, static_cast<off_t>(new_length)) == 0 && remap(new_length);
+    }
+
+    char *data(void) const {
+        return map;
+    }
+
+    size_t size(void) const {
+        return length;
+    }
+
+    void swap(mapped_file &other) {
+        std::swap(fd, other.fd);
+        std::swap(map, other.map);
+        std::swap(length, other.length);
+    }
+
+    void close_file(void) {
+        if (map != nullptr)
+            munmap(map, length);
+        if (fd >= 0)
+            ::close(fd);
+
+        map = nullptr;
+        length = 0;
+        fd = -1;
+    }
+
+private:
+    int fd = -1;
+    char *map = nullptr;
+    size_t length = 0;
+
+    // the old mapping is kept if the new one cannot be made
+    bool remap(size_t new_length) {
+        void *res = nullptr;
+
+        if (new_length != 0) {
+            res = mmap(nullptr, new_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (res == MAP_FAILED)
+                return false;
+        }
+
+        if (map != nullptr)
+            munmap(map, length);
+
+        map = static_cast<char*>(res);
+        length = new_length;
+
+        return true;
+    }
+};
+
+// queue kept in two memory-mapped files: an append-only data file
+// of (length, bytes, NUL) records and an index file holding a header
+// and the offsets of the records in queue order;
+// the entries between begin and end of the header are the queue, and
+// a single aligned store to begin or end commits an operation at
+// either end, so a crashed process leaves the last committed state;
+// operations elsewhere in the queue, clear and compaction write
+// a new generation of both files and commit it by renaming the index
+class persistent_storage final : public storage {
+public:
+    // returns nullptr if the files cannot be opened or are damaged
+    static unique_ptr<persistent_storage> open(const char *path) {
+        unique_ptr<persistent_storage> res(new persistent_storage(path));
+
+        if (!res->open_files())
+            return nullptr;
+
+        return res;
+    }
+
+    size_t size(void) const override {
+        return header()->end - header()->begin;
+    }
+
+    string_view at(size_t position) const override {
+        return record(offsets()[header()->begin + position]);
+    }
+
+    bool insert(size_t position, string_view str) override {
+        index_header *h = header();
+        uint64_t offset;
+
+        if (!storable(str))
+            return false;
+
+        if (position == size()) {
+            // growing the index moves it, header is fetched again
+            if (!index.reserve(header_size + (h->end + 1) * sizeof(uint64_t))
+                    || !append(str, offset))
+                return false;
+
+            h = header();
+            offsets()[h->end] = offset;
+            commit(h->end, h->end + 1);
+        }
+        else if (position == 0 && h->begin > 0) {
+            if (!append(str, offset))
+                return false;
+
+            h = header();
+            offsets()[h->begin - 1] = offset;
+            commit(h->begin, h->begin - 1);
+        }
+        else {
+            const size_t n = size() + 1;
+
+            return rewrite(n, [&](size_t i) {
+                return i < position ? at(i) : (i == position ? str : at(i - 1));
+            });
+        }
+
+        h->live_bytes += record_size(str.size());
+        return true;
+    }
+
+    // strings at the end are appended and committed together
+    bool insert_range(size_t position, const string_view *strs, size_t n) override {
+        if (n == 0)
+            return true;
+
+        for (size_t i = 0; i < n; ++i)
+            if (!storable(strs[i]))
+                return false;
+
+        if (position != size()) {
+            return rewrite(size() + n, [&](size_t i) {
+                return i < position ? at(i)
+                        : (i < position + n ? strs[i - position] : at(i - n));
+            });
+        }
+
+        vector<uint64_t> new_offsets(n);
+        vector<string_view> views(strs, strs + n);
+        uint64_t bytes = 0;
+
+        // both files grow once, before any string is copied,
+        // so that none of the appends below can fail
+        if (!index.reserve(header_size + (header()->end + n) * sizeof(uint64_t))
+                || !reserve_records(views.data(), n))
+            return false;
+
+        for (size_t i = 0; i < n; ++i) {
+            append(views[i], new_offsets[i]);
+            bytes += record_size(views[i].size());
+        }
+
+        index_header *h = header();
+
+        memcpy(offsets() + h->end, new_offsets.data(), n * sizeof(uint64_t));
+        commit(h->end, h->end + n);
+        h->live_bytes += bytes;
+        return true;
+    }
+
+    bool erase(size_t position) override {
+        return erase_range(position, 1);
+    }
+
+    bool erase_range(size_t position, size_t count) override {
+        if (count == 0)
+            return true;
+
+        index_header *h = header();
+        uint64_t bytes = 0;
+
+        if (position != 0 && position + count != size()) {
+            return rewrite(size() - count, [&](size_t i) {
+                return at(i < position ? i : i + count);
+            });
+        }
+
+        for (size_t i = 0; i < count; ++i)
+            bytes += record_size(at(position + i).size());
+
+        if (position == 0)
+            commit(h->begin, h->begin + count);
+        else
+            commit(h->end, h->end - count);
+
+        h->live_bytes = h->live_bytes > bytes ? h->live_bytes - bytes : 0;
+
+        // the log is compacted once removed strings outweigh live ones;
+        // the strings are gone already if that fails, it is tried again
+        // by the next removal
+        if (h->data_end > compaction_threshold && h->data_end > 2 * h->live_bytes)
+            rewrite(size(), [&](size_t i) { return at(i); });
+        return true;
+    }
+
+    bool clear(void) override {
+        return rewrite(0, [&](size_t i) { return at(i); });
+    }
+
+    bool load_summary(uint64_t &hash, size_t &bytes) override {
+        index_header *h = header();
+
+        if (h->hash_begin != h->begin || h->hash_end != h->end
+                || h->live_bytes < size() * record_size(0))
+            return false;
+
+        hash = h->hash;
+        bytes = h->live_bytes - size() * record_size(0);
+
+        // modifications at either end can bring begin and end back
+        // to the saved ones with other strings between them
+        commit(h->hash_end, numeric_limits<uint64_t>::max());
+        return true;
+    }
+
+    void save_hash(uint64_t hash) override {
+        index_header *h = header();
+
+        // invalidated first, so that a torn update is never trusted
+        commit(h->hash_end, numeric_limits<uint64_t>::max());
+        commit(h->hash, hash);
+        commit(h->hash_begin, h->begin);
+        commit(h->hash_end, h->end);
+    }
+
+private:
+    static constexpr uint64_t magic = 0x6575657571727473u; // "strqueue"
+    static constexpr size_t compaction_threshold = 1 << 20;
+
+    struct index_header {
+        uint64_t magic;
+        // suffix of the current data file name
+        uint64_t generation;
+        // indices of the first and one past the last offset in the queue
+        uint64_t begin, end;
+        // bytes of the data file taken up by records
+        uint64_t data_end;
+        // bytes of records still in the queue
+        uint64_t live_bytes;
+        // content hash of the queue as it was between hash_begin and hash_end
+        uint64_t hash, hash_begin, hash_end;
+    };
+
+    // offsets start at a cache line boundary after the header
+    static constexpr size_t header_size = 128;
+
+    static_assert(sizeof(index_header) <= header_size, "index header too big");
+
+    const string path;
+    // the lock of path.lock, a file that is never replaced, keeps other
+    // processes out; it is released after the other files are closed
+    mapped_file lock, index, data;
+
+    explicit persistent_storage(const char *file) : path(file) {}
+
+    string data_path(uint64_t generation) const {
+        return path + ".data." + std::to_string(generation);
+    }
+
+    index_header *header(void) const {
+        return reinterpret_cast<index_header*>(index.data());
+    }
+
+    uint64_t *offsets(void) const {
+        return reinterpret_cast<uint64_t*>(index.data() + header_size);
+    }
+
+    size_t capacity(void) const {
+        return (index.size() - header_size) / sizeof(uint64_t);
+    }
+
+    static size_t record_size(size_t len) {
+        return sizeof(uint32_t) + len + 1;
+    }
+
+    string_view record(uint64_t offset) const {
+        uint32_t len;
+
+        memcpy(&len, data.data() + offset, sizeof(len));
+        return string_view(data.data() + offset + sizeof(len), len);
+    }
+
+    // stores that the crash consistency depends on stay in program order;
+    // other processes see them in the page cache as soon as they are made
+    static void commit(uint64_t &field, uint64_t value) {
+        atomic_signal_fence(memory_order_seq_cst);
+        field = value;
+        atomic_signal_fence(memory_order_seq_cst);
+    }
+
+    static void put_record(char *dest, string_view str) {
+        const uint32_t len = static_cast<uint32_t>(str.size());
+
+        memcpy(dest, &len, sizeof(len));
+        memcpy(dest + sizeof(len), str.data(), str.size());
+        dest[sizeof(len) + str.size()] = '\0';
+    }
+
+    // records hold 32-bit lengths
+    static bool storable(string_view str) {
+        return str.size() <= numeric_limits<uint32_t>::max();
+    }
+
+    // writes a record past the end of the log and stores its offset,
+    // false if the string is too long or the log cannot grow; the record only becomes part of
+    // the queue once its offset does
+    bool append(string_view str, uint64_t &offset) {
+        if (!storable(str) || !reserve_records(&str, 1))
+            return false;
+
+        offset = header()->data_end;
+
+        put_record(data.data() + offset, str);
+        commit(header()->data_end, offset + record_size(str.size()));
+
+        return true;
+    }
+
+    // makes room for records of n strings past the end of the log; growing
+    // it remaps the data file, so strings in it are moved to the new mapping
+    bool reserve_records(string_view *strs, size_t n) {
+        uint64_t needed = header()->data_end;
+
+        for (size_t i = 0; i < n; ++i)
+            needed += record_size(strs[i].size());
+
+        if (needed <= data.size())
+            return true;
+
+        const char *old = data.data();
+        const less<const char*> before;
+        vector<pair<size_t, size_t>> moved;
+
+        for (size_t i = 0; i < n; ++i)
+            if (old != nullptr && !before(strs[i].data(), old)
+                    && before(strs[i].data(), old + data.size()))
+                moved.emplace_back(i, static_cast<size_t>(strs[i].data() - old));
+
+        if (!data.reserve(needed))
+            return false;
+
+        for (auto [i, offset] : moved)
+            strs[i] = string_view(data.data() + offset, strs[i].size());
+
+        return true;
+    }
+
+    bool open_files(void) {
+        // the index is replaced by every rewrite, so its own lock would
+        // not keep out a process that opened the one before
+        if (!lock.open_file(path + ".lock", true, true))
+            return false;
+
+        if (!index.open_file(path, false, true)) {
+            if (errno != ENOENT)
+                return false;
+
+            // a new queue is an empty generation written from scratch
+            unlink((path + ".tmp").c_str());
+            return rewrite(0, [](size_t) { return string_view(); });
+        }
+
+        const index_header *h = header();
+
+        if (index.size() < header_size || h->magic != magic || h->begin > h->end
+                || h->end > capacity())
+            return false;
+
+        // leftovers of an interrupted rewrite
+        unlink((path + ".tmp").c_str());
+        unlink(data_path(h->generation + 1).c_str());
+
+        if (!data.open_file(data_path(h->generation), false, false)
+                || data.size() < h->data_end)
+            return false;
+
+        // every record of the queue must lie within the log, which is
+        // checked once here instead of by every access
+        for (uint64_t i = h->begin; i < h->end; ++i)
+            if (!valid_record(offsets()[i]))
+                return false;
+
+        return true;
+    }
+
+    bool valid_record(uint64_t offset) const {
+        const uint64_t data_end = header()->data_end;
+        uint32_t len;
+
+        if (data_end < record_size(0) || offset > data_end - record_size(0))
+            return false;
+
+        memcpy(&len, data.data() + offset, sizeof(len));
+        return record_size(len) <= data_end - offset
+                && data.data()[offset + sizeof(len) + len] == '\0';
+    }
+
+    // replaces the queue with n strings returned by str_at in a new
+    // generation of the files, leaving room for insertions at the front;
+    // false if the files cannot be written, which leaves the old ones
+    template<typename StrAt>
+    bool rewrite(size_t n, StrAt str_at) {
+        const uint64_t generation = (index.data() == nullptr) ? 1 : header()->generation + 1;
+        const size_t headroom = n / 2 + 16;
+        mapped_file new_index, new_data;
+        uint64_t data_end = 0;
+
+        for (size_t i = 0; i < n; ++i)
+            data_end += record_size(str_at(i).size());
+
+        if (!new_index.open_file(path + ".tmp", true, true)
+                || !new_index.reserve(header_size + (headroom + n + 1) * sizeof(uint64_t))
+                || !new_data.open_file(data_path(generation), true, false)
+                || !new_data.reserve(data_end)) {
+            discard(generation);
+            return false;
+        }
+
+        auto *h = reinterpret_cast<index_header*>(new_index.data());
+        auto *offs = reinterpret_cast<uint64_t*>(new_index.data() + header_size);
+        uint64_t offset = 0;
+
+        for (size_t i = 0; i < n; ++i) {
+            const string_view str = str_at(i);
+
+            put_record(new_data.data() + offset, str);
+            offs[headroom + i] = offset;
+            offset += record_size(str.size());
+        }
+
+        *h = index_header{magic, generation, headroom, headroom + n, data_end, data_end,
+                            0, 0, numeric_limits<uint64_t>::max()};
+
+        if (rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+            discard(generation);
+            return false;
+        }
+
+        index.close_file();
+        data.close_file();
+        unlink(data_path(generation - 1).c_str());
+
+        index.swap(new_index);
+        data.swap(new_data);
+        return true;
+    }
+
+    // removes the files of a generation that has not been committed
+    void discard(uint64_t generation) {
+        unlink((path + ".tmp").c_str());
+        unlink(data_path(generation).c_str());
+    }
+};
+#endif
+
+// empty storage of the kind given by flags, defined with the last backend
+unique_ptr<storage> make_storage(unsigned int flags);
+
+unique_ptr<storage> storage::clone(void) const {
+    vector<string_view> strs(size());
+
+    for (size_t i = 0; i < strs.size(); ++i)
+        strs[i] = at(i);
+
+    auto res = make_storage(kind().value_or(STRQUEUE_DEQUE));
+    res->assign(strs.data(), strs.size());
+    return res;
+}
+
+// backend of new queues: up to inline_count short strings are kept in
+// a buffer inside the object, so creating, filling and deleting a small
+// queue allocates nothing; a queue outgrowing it moves its elements to
+// storage of its kind for good, until it is cleared
+class small_storage final : public storage {
+public:
+    explicit small_storage(unsigned int flags) : kind_flags(flags & STRQUEUE_KIND_MASK) {}
+
+    size_t size(void) const override {
+        return large ? large->size() : count;
+    }
+
+    string_view at(size_t position) const override {
+        if (large)
+            return large->at(position);
+
+        return string_view(bytes + starts[position],
+                            starts[position + 1] - starts[position] - 1);
+    }
+
+    bool insert(size_t position, string_view str) override {
+        if (!large && !fits(1, str.size() + 1))
+            grow();
+
+        if (large)
+            return large->insert(position, str);
+
+        // a string from this queue would be shifted before it is copied
+        char copy[inline_bytes];
+
+        if (inside(str))
+            str = string_view(static_cast<char*>(memcpy(copy, str.data(), str.size())),
+                                str.size());
+
+        const size_t needed = str.size() + 1;
+        char *dest = bytes + starts[position];
+
+        memmove(dest + needed, dest, starts[count] - starts[position]);
+        memcpy(dest, str.data(), str.size());
+        dest[str.size()] = '\0';
+
+        for (size_t i = ++count; i > position; --i)
+            starts[i] = starts[i - 1] + needed;
+        return true;
+    }
+
+    bool insert_moved(size_t position, string &&str) override {
+        if (!large && !fits(1, str.size() + 1))
+            grow();
+
+        if (large)
+            return large->insert_moved(position, move(str));
+
+        return insert(position, string_view(str));
+    }
+
+    bool erase(size_t position) override {
+        return erase_range(position, 1);
+    }
+
+    bool clear(void) override {
+        large.reset();
+        count = 0;
+        return true;
+    }
+
+    bool insert_range(size_t position, const string_view *strs, size_t n) override {
+        size_t needed = 0;
+
+        for (size_t i = 0; i < n && needed <= inline_bytes; ++i)
+            needed += strs[i].size() + 1;
+
+        if (!large && !fits(n, needed))
+            grow();
+
+        if (large)
+            return large->insert_range(position, strs, n);
+
+        // strings from this queue are copied before any of them is shifted
+        char copies[inline_bytes];
+        string_view views[inline_count];
+        size_t copied = 0;
+
+        for (size_t i = 0; i < n; ++i) {
+            views[i] = strs[i];
+
+            if (inside(strs[i])) {
+                memcpy(copies + copied, strs[i].data(), strs[i].size());
+                views[i] = string_view(copies + copied, strs[i].size());
+                copied += strs[i].size();
+            }
+        }
+
+        for (size_t i = 0; i < n; ++i)
+            insert(position + i, views[i]);
+        return true;
+    }
+
+    bool erase_range(size_t position, size_t n) override {
+        if (large)
+            return large->erase_range(position, n);
+
+        const size_t removed = starts[position + n] - starts[position];
+
+        memmove(bytes + starts[position], bytes + starts[position + n],
+                starts[count] - starts[position + n]);
+
+        count -= n;
+        for (size_t i = position + 1; i <= count; ++i)
+            starts[i] = starts[i + n] - removed;
+        return true;
+    }
+
+    void get_range(size_t position, size_t n, const char **out) const override {
+        if (large)
+            large->get_range(position, n, out);
+        else
+            storage::get_range(position, n, out);
+    }
+
+    void get_views(size_t position, size_t n, string_view *out) const override {
+        if (large)
+            large->get_views(position, n, out);
+        else
+            storage::get_views(position, n, out);
+    }
+
+    size_t find(string_view str, size_t start) const override {
+        return large ? large->find(str, start) : storage::find(str, start);
+    }
+
+    void assign(const string_view *strs, size_t n) override {
+        clear();
+
+        size_t needed = 0;
+
+        for (size_t i = 0; i < n && needed <= inline_bytes; ++i)
+            needed += strs[i].size() + 1;
+
+        if (!fits(n, needed)) {
+            large = make_storage(kind_flags);
+            large->assign(strs, n);
+            return;
+        }
+
+        for (size_t i = 0; i < n; ++i)
+            insert(i, strs[i]);
+    }
+
+    optional<unsigned int> kind(void) const override {
+        return kind_flags;
+    }
+
+    // a reservation beyond what fits inline moves the elements to storage
+    // of their kind right away
+    void reserve(size_t n, size_t needed) override {
+        if (!large && !fits(n, needed))
+            grow();
+
+        if (large)
+            large->reserve(n, needed);
+    }
+
+    void shrink_to_fit(void) override {
+        if (large)
+            large->shrink_to_fit();
+    }
+
+    // the storage the elements have been moved to, if any, leaving this empty
+    unique_ptr<storage> release_large(void) {
+        count = 0;
+        return move(large);
+    }
+
+    unique_ptr<storage> clone(void) const override {
+        auto res = make_unique<small_storage>(kind_flags);
+
+        if (large) {
+            res->large = large->clone();
+        } else {
+            res->count = count;
+            memcpy(res->starts, starts, sizeof(starts));
+            memcpy(res->bytes, bytes, starts[count]);
+        }
+
+        return res;
+    }
+
+    // inline elements are copied by a clone, not shared
+    const void *shared_elements(void) const override {
+        return large ? large->shared_elements() : nullptr;
+    }
+
+private:
+    static constexpr size_t inline_count = 8;
+    static constexpr size_t inline_bytes = 128;
+
+    // kind of storage to move to
+    const unsigned int kind_flags;
+    unique_ptr<storage> large;
+    uint8_t count = 0;
+    // string i, followed by a NUL, takes up bytes from starts[i] to starts[i + 1]
+    uint8_t starts[inline_count + 1] = {};
+    char bytes[inline_bytes];
+
+    static_assert(inline_bytes <= numeric_limits<uint8_t>::max(), "offsets too small");
+
+    // whether str is in the inline buffer
+    bool inside(string_view str) const {
+        const less<const char*> before;
+        return !before(str.data(), bytes) && before(str.data(), bytes + inline_bytes);
+    }
+
+    // whether n more strings taking up needed bytes with NULs fit inline
+    bool fits(size_t n, size_t needed) const {
+        return count + n <= inline_count && needed <= inline_bytes - starts[count];
+    }
+
+    void grow(void) {
+        string_view strs[inline_count];
+
+        for (size_t i = 0; i < count; ++i)
+            strs[i] = at(i);
+
+        unique_ptr<storage> res = make_storage(kind_flags);
+        res->assign(strs, count);
+        large = move(res);
+    }
+};
+
+// index of the first byte at which a and b differ, n if there is none;
+// what the kernels below return past the checked blocks
+size_t mismatch_scalar(const unsigned char *a, const unsigned char *b, size_t n) {
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x, y;
+
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y)
+            break;
+    }
+
+    while (i < n && a[i] == b[i])
+        ++i;
+
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 16 bytes at a time, SSE2 is part of every x86-64 processor
+size_t mismatch_sse2(const unsigned char *a, const unsigned char *b, size_t n) {
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+
+        if (mask != 0xffffu)
+            return i + __builtin_ctz(~mask);
+    }
+
+    return i + mismatch_scalar(a + i, b + i, n - i);
+}
+
+// 32 bytes at a time, used only if the processor supports AVX2
+__attribute__((target("avx2")))
+size_t mismatch_avx2(const unsigned char *a, const unsigned char *b, size_t n) {
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        const unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+
+        if (mask != 0xffffffffu)
+            return i + __builtin_ctz(~mask);
+    }
+
+    return i + mismatch_sse2(a + i, b + i, n - i);
+}
+#elif defined(__aarch64__)
+// 16 bytes at a time, NEON is part of every AArch64 processor
+size_t mismatch_neon(const unsigned char *a, const unsigned char *b, size_t n) {
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        const uint8x16_t eq = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+
+        if (vminvq_u8(eq) != 0xff)
+            break;
+    }
+
+    return i + mismatch_scalar(a + i, b + i, n - i);
+}
+#endif
+
+using mismatch_kernel = size_t (*)(const unsigned char*, const unsigned char*, size_t);
+
+// picks the widest kernel the processor supports
+mismatch_kernel select_mismatch_kernel(void) {
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2"))
+        return mismatch_avx2;
+#endif
+    return mismatch_sse2;
+#elif defined(__aarch64__)
+    return mismatch_neon;
+#else
+    return mismatch_scalar;
+#endif
+}
+
+size_t mismatch(const char *a, const char *b, size_t n) {
+    static const mismatch_kernel kernel = select_mismatch_kernel();
+
+    const auto *x = reinterpret_cast<const unsigned char*>(a);
+    const auto *y = reinterpret_cast<const unsigned char*>(b);
+
+    // short strings are not worth a call through the pointer
+    if (n < 16)
+        return mismatch_scalar(x, y, n);
+
+    return kernel(x, y, n);
+}
+
+// same result as s1.compare(s2) reduced to -1, 0 or 1
+int compare_strings(string_view s1, string_view s2) {
+    // the same bytes, as with interned or shared elements
+    if (s1.data() == s2.data() && s1.size() == s2.size())
+        return 0;
+
+    const size_t common = s1.size() < s2.size() ? s1.size() : s2.size();
+    const size_t i = mismatch(s1.data(), s2.data(), common);
+
+    if (i < common)
+        return static_cast<unsigned char>(s1[i]) < static_cast<unsigned char>(s2[i])
+                    ? -1 : 1;
+
+    if (s1.size() == s2.size())
+        return 0;
+
+    return s1.size() < s2.size() ? -1 : 1;
+}
+
+bool equal_strings(string_view s1, string_view s2) {
+    return s1.size() == s2.size()
+            && (s1.data() == s2.data() || mismatch(s1.data(), s2.data(), s1.size()) == s1.size());
+}
+
+size_t storage::find(string_view str, size_t start) const {
+    for (size_t i = start; i < size(); ++i)
+        if (equal_strings(at(i), str))
+            return i;
+
+    return STRQUEUE_NOT_FOUND;
+}
+
+// lexicographical comparison of two queues, returns -1, 0 or 1
+int storage_compare(const storage &q1, const storage &q2) {
+    const size_t size1 = q1.size(), size2 = q2.size();
+    const size_t common = size1 < size2 ? size1 : size2;
+
+    if (q1.same_as(q2))
+        return 0;
+
+    for (size_t i = 0; i < common; ++i) {
+        const int res = compare_strings(q1.at(i), q2.at(i));
+
+        if (res != 0)
+            return res;
+    }
+
+    if (size1 == size2)
+        return 0;
+
+    return size1 < size2 ? -1 : 1;
+}
+
+// stands in for a lock in single-threaded builds, compiles to nothing
+struct null_mutex {
+    void lock(void) {}
+    bool try_lock(void) { return true; }
+    void unlock(void) {}
+    void lock_shared(void) {}
+    bool try_lock_shared(void) { return true; }
+    void unlock_shared(void) {}
+};
+
+// locking policies: the locks and counters used throughout and the number
+// of independently locked parts of the registry and the string pool;
+// the one chosen by the build options is the only one instantiated
+struct unlocked {
+    using registry_mutex = null_mutex;
+    using sink_mutex = null_mutex;
+    using stats_mutex = null_mutex;
+    using id_counter = unsigned long;
+    using stat_counter = unsigned long;
+    using pool_mutex = null_mutex;
+    using pack_mutex = null_mutex;
+
+    static constexpr size_t shard_count = 1;
+};
+
+// Shards is a power of 2, 1 makes a single lock guard the whole registry
+template<size_t Shards>
+struct locked {
+    static_assert(Shards > 0 && (Shards & (Shards - 1)) == 0,
+                    "the number of shards must be a power of 2");
+
+    using registry_mutex = shared_mutex;
+    using sink_mutex = std::mutex;
+    using stats_mutex = std::mutex;
+    using id_counter = atomic<unsigned long>;
+    using stat_counter = atomic<unsigned long>;
+    using pool_mutex = std::mutex;
+    using pack_mutex = std::mutex;
+
+    static constexpr size_t shard_count = Shards;
+};
+
+#ifdef STRQUEUE_THREAD_SAFE
+#ifndef STRQUEUE_SHARDS
+#define STRQUEUE_SHARDS 64
+#endif
+using locking = locked<STRQUEUE_SHARDS>;
+#else
+using locking = unlocked;
+#endif
+
+using registry_mutex = locking::registry_mutex;
+using sink_mutex = locking::sink_mutex;
+using stats_mutex = locking::stats_mutex;
+using id_counter = locking::id_counter;
+using stat_counter = locking::stat_counter;
+using pool_mutex = locking::pool_mutex;
+using pack_mutex = locking::pack_mutex;
+
+constexpr size_t shard_count = locking::shard_count;
+
+// strings of all interned queues, each kept once together with the number
+// of elements referring to it; split into shards locked independently
+class string_pool {
+public:
+    struct entry {
+        mutable atomic<size_t> refs;
+        size_t hash;
+        size_t length;
+
+        // the bytes follow the entry, NUL-terminated
+        string_view view(void) const {
+            return string_view(reinterpret_cast<const char*>(this + 1), length);
+        }
+    };
+
+    string_pool(void) = default;
+
+    string_pool(const string_pool &) = delete;
+
+    string_pool &operator=(const string_pool &) = delete;
+
+    // the entry holding str, with a reference more
+    const entry *acquire(string_view str) {
+        const size_t hash = std::hash<string_view>()(str);
+        auto &shard = shards[hash % shard_count];
+        lock_guard<pool_mutex> guard(shard.mutex);
+        auto it = shard.entries.find(str);
+
+        if (it != shard.entries.end()) {
+            it->second->refs.fetch_add(1, memory_order_relaxed);
+            return it->second;
+        }
+
+        entry *res = static_cast<entry*>(malloc(sizeof(entry) + str.size() + 1));
+
+        if (res == nullptr)
+            throw std::bad_alloc();
+
+        new (res) entry{{1}, hash, str.size()};
+
+        char *bytes = reinterpret_cast<char*>(res + 1);
+        memcpy(bytes, str.data(), str.size());
+        bytes[str.size()] = '\0';
+
+        try {
+            shard.entries.emplace(res->view(), res);
+        }
+        catch (...) {
+            free(res);
+            throw;
+        }
+
+        return res;
+    }
+
+    // another reference to an entry the caller already refers to
+    static void retain(const entry *e) {
+        e->refs.fetch_add(1, memory_order_relaxed);
+    }
+
+    void release(const entry *e) {
+        size_t refs = e->refs.load(memory_order_relaxed);
+
+        // the last reference is dropped under the lock, so that acquire
+        // cannot find the entry while it is being freed
+        while (refs > 1)
+            if (e->refs.compare_exchange_weak(refs, refs - 1, memory_order_release,
+                                                memory_order_relaxed))
+                return;
+
+        auto &shard = shards[e->hash % shard_count];
+        lock_guard<pool_mutex> guard(shard.mutex);
+
+        if (e->refs.fetch_sub(1, memory_order_acq_rel) != 1)
+            return;
+
+        shard.entries.erase(e->view());
+        e->~entry();
+        free(const_cast<entry*>(e));
+    }
+
+    // the entry holding str, nullptr if no queue has it; no reference is
+    // taken, so the result may only be compared with entries held
+    const entry *lookup(string_view str) {
+        auto &shard = shards[std::hash<string_view>()(str) % shard_count];
+        lock_guard<pool_mutex> guard(shard.mutex);
+        auto it = shard.entries.find(str);
+
+        return it == shard.entries.end() ? nullptr : it->second;
+    }
+
+private:
+    struct alignas(64) pool_shard {
+        pool_mutex mutex;
+        // keys are views of the entries themselves
+        unordered_map<string_view, entry*> entries;
+    };
+
+    array<pool_shard, shard_count> shards;
+};
+
+// never destroyed, since interned queues are freed at exit after
+// any other static object could have been
+string_pool &get_string_pool(void) {
+    static string_pool *pool = new string_pool;
+    return *pool;
+}
+
+// elements are handles of strings in the global string_pool, so every
+// distinct string is stored once however many queues hold it, and equal
+// elements have equal addresses; clones share the handles until either
+// of them is modified, which copies them
+class intern_storage final : public storage {
+public:
+    intern_storage(void) : state(std::make_shared<contents>()) {}
+
+    size_t size(void) const override {
+        return state->handles.size();
+    }
+
+    string_view at(size_t position) const override {
+        return state->handles[position]->view();
+    }
+
+    bool insert(size_t position, string_view str) override {
+        auto &handles = writable();
+        const handle h = get_string_pool().acquire(str);
+
+        if (position == handles.size())
+            handles.push_back(h);
+        else
+            handles.insert(handles.begin() + position, h);
+        return true;
+    }
+
+    bool erase(size_t position) override {
+        return erase_range(position, 1);
+    }
+
+    bool clear(void) override {
+        // shared handles are left to the clones instead of being copied
+        if (!unshared(state)) {
+            state = std::make_shared<contents>();
+            return true;
+        }
+
+        state->release_all();
+        return true;
+    }
+
+    bool insert_range(size_t position, const string_view *strs, size_t n) override {
+        // see arena_storage::insert_range
+        if (n == 0)
+            return true;
+
+        auto &handles = writable();
+        auto first = handles.insert(handles.begin() + position, n, nullptr);
+
+        for (size_t i = 0; i < n; ++i, ++first)
+            *first = get_string_pool().acquire(strs[i]);
+        return true;
+    }
+
+    bool erase_range(size_t position, size_t count) override {
+        auto &handles = writable();
+        const auto first = handles.begin() + position;
+
+        for (auto it = first; it != first + count; ++it)
+            get_string_pool().release(*it);
+        handles.erase(first, first + count);
+        return true;
+    }
+
+    // strings are in the pool, only the deque of handles has any slack
+    void shrink_to_fit(void) override {
+        if (unshared(state))
+            state->handles.shrink_to_fit();
+    }
+
+    // elements are equal to str exactly if they have its handle
+    size_t find(string_view str, size_t start) const override {
+        const handle h = get_string_pool().lookup(str);
+        const auto &handles = state->handles;
+
+        if (h == nullptr || start >= handles.size())
+            return STRQUEUE_NOT_FOUND;
+
+        const auto it = std::find(handles.begin() + start, handles.end(), h);
+
+        return it == handles.end() ? STRQUEUE_NOT_FOUND : it - handles.begin();
+    }
+
+    void assign(const string_view *strs, size_t n) override {
+        clear();
+
+        auto &handles = state->handles;
+
+        handles.resize(n);
+        for (size_t i = 0; i < n; ++i)
+            handles[i] = get_string_pool().acquire(strs[i]);
+    }
+
+    optional<unsigned int> kind(void) const override {
+        return STRQUEUE_INTERN;
+    }
+
+    unique_ptr<storage> clone(void) const override {
+        return unique_ptr<storage>(new intern_storage(state));
+    }
+
+    const void *shared_elements(void) const override {
+        return state.get();
+    }
+
+private:
+    using handle = const string_pool::entry*;
+
+    // handles referring to the pool, released with the last owner
+    struct contents {
+        deque<handle> handles;
+
+        contents(void) = default;
+
+        contents(const contents &other) : handles(other.handles) {
+            for (handle h : handles)
+                string_pool::retain(h);
+        }
+
+        contents &operator=(const contents &) = delete;
+
+        ~contents(void) {
+            release_all();
+        }
+
+        void release_all(void) {
+            for (handle h : handles)
+                get_string_pool().release(h);
+            handles.clear();
+        }
+    };
+
+    shared_ptr<contents> state;
+
+    explicit intern_storage(shared_ptr<contents> shared) : state(move(shared)) {}
+
+    // the handles, copied first if a clone shares them
+    deque<handle> &writable(void) {
+        if (!unshared(state))
+            state = std::make_shared<contents>(*state);
+
+        return state->handles;
+    }
+};
+
+unique_ptr<storage> make_storage(unsigned int flags) {
+    switch (flags & STRQUEUE_KIND_MASK) {
+        case STRQUEUE_TREE:
+            return make_unique<tree_storage>();
+        case STRQUEUE_ARENA:
+            return make_unique<arena_storage>(node_of(flags));
+        case STRQUEUE_INTERN:
+            return make_unique<intern_storage>();
+        default:
+            return make_unique<deque_storage>();
+    }
+}
+
+// per-thread counters behind strqueue_stats: every thread writes only
+// its own ones, with plain relaxed stores, and readers add them all up
+using cxx::strqueue_function;
+
+constexpr size_t function_count = cxx::STRQUEUE_FN_COUNT;
+
+enum class failure {
+    missing_queue,
+    bad_position,
+    over_limit,
+    rejected,
+    count
+};
+
+struct thread_metrics {
+    array<atomic<uint64_t>, function_count> calls{}, failures{};
+    array<atomic<uint64_t>, size_t(failure::count)> causes{};
+    // bytes added minus bytes removed by this thread
+    atomic<int64_t> bytes{0};
+    // compressed queues and the size of their blocks, packed by this
+    // thread minus unpacked or freed by it, and the queues it unpacked
+    atomic<int64_t> packed_queues{0}, packed_bytes{0};
+    atomic<uint64_t> unpacks{0};
+    array<array<atomic<uint64_t>, STRQUEUE_LATENCY_BUCKETS>, function_count> latency{};
+
+    // function being called, failures are counted against it
+    strqueue_function current = cxx::STRQUEUE_FN_NEW;
+    // calls left until the next sampled one
+    unsigned int until_sample = 0;
+    // bytes of the global budget taken by this thread and not used yet
+    uint64_t credit = 0;
+};
+
+template<typename T>
+void add(atomic<T> &counter, T value) {
+    counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+// counters of all threads, and those of exited threads added together
+class metrics_registry {
+public:
+    void attach(thread_metrics *metrics) {
+        lock_guard<stats_mutex> guard(mutex);
+        threads.push_back(metrics);
+    }
+
+    void detach(thread_metrics *metrics) {
+        lock_guard<stats_mutex> guard(mutex);
+
+        threads.erase(std::find(threads.begin(), threads.end(), metrics));
+
+        for (size_t f = 0; f < function_count; ++f) {
+            add(retired.calls[f], metrics->calls[f].load(memory_order_relaxed));
+            add(retired.failures[f], metrics->failures[f].load(memory_order_relaxed));
+            for (size_t b = 0; b < STRQUEUE_LATENCY_BUCKETS; ++b)
+                add(retired.latency[f][b], metrics->latency[f][b].load(memory_order_relaxed));
+        }
+        for (size_t c = 0; c < size_t(failure::count); ++c)
+            add(retired.causes[c], metrics->causes[c].load(memory_order_relaxed));
+        add(retired.bytes, metrics->bytes.load(memory_order_relaxed));
+        add(retired.packed_queues, metrics->packed_queues.load(memory_order_relaxed));
+        add(retired.packed_bytes, metrics->packed_bytes.load(memory_order_relaxed));
+        add(retired.unpacks, metrics->unpacks.load(memory_order_relaxed));
+    }
+
+    // calls f on the counters of every thread
+    template<typename F>
+    void for_each(F f) {
+        lock_guard<stats_mutex> guard(mutex);
+
+        f(retired);
+        for (const thread_metrics *metrics : threads)
+            f(*metrics);
+    }
+
+private:
+    stats_mutex mutex;
+    vector<thread_metrics*> threads;
+    thread_metrics retired;
+};
+
+// prevents static initialisation order fiasco; constructed before
+// any thread_metrics_holder, so it is also destroyed after them
+metrics_registry &get_metrics_registry(void) {
+    static metrics_registry registry;
+    return registry;
+}
+
+// the global byte limit caps the bytes of all queues together with
+// the credit that threads take from the shared budget in batches,
+// so that most insertions and removals touch only their own thread
+constexpr uint64_t budget_batch = 1 << 16;
+
+atomic<uint64_t> global_byte_limit{0};
+
+// stored bytes plus the credit of every thread
+atomic<uint64_t> budget_taken{0};
+
+struct thread_metrics_holder {
+    thread_metrics metrics;
+
+    thread_metrics_holder(void) {
+        get_metrics_registry().attach(&metrics);
+    }
+
+    ~thread_metrics_holder(void) {
+        get_metrics_registry().detach(&metrics);
+        budget_taken.fetch_sub(metrics.credit, memory_order_relaxed);
+    }
+};
+
+thread_metrics &local_metrics(void) {
+    thread_local thread_metrics_holder holder;
+    return holder.metrics;
+}
+
+// every how many calls one is timed, 0 if none is
+atomic<unsigned int> sampling_period{0};
+
+// counts a call of an API function for as long as it is in scope,
+// and times it if it is sampled
+class call_scope {
+public:
+    explicit call_scope(strqueue_function function) : metrics(local_metrics()) {
+        const unsigned int period = sampling_period.load(memory_order_relaxed);
+
+        add(metrics.calls[function], uint64_t(1));
+        metrics.current = function;
+
+        if (period != 0 && metrics.until_sample-- == 0) {
+            metrics.until_sample = period - 1;
+            sampled = true;
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    call_scope(const call_scope &) = delete;
+
+    call_scope &operator=(const call_scope &) = delete;
+
+    ~call_scope(void) {
+        if (!sampled)
+            return;
+
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start).count();
+        size_t bucket = 0;
+
+        while (bucket + 1 < STRQUEUE_LATENCY_BUCKETS && (ns >> (bucket + 1)) != 0)
+            ++bucket;
+
+        add(metrics.latency[metrics.current][bucket], uint64_t(1));
+    }
+
+private:
+    thread_metrics &metrics;
+    bool sampled = false;
+    std::chrono::steady_clock::time_point start;
+};
+
+// counts a failure of the function being called
+void count_failure(failure cause) {
+    thread_metrics &metrics = local_metrics();
+
+    add(metrics.failures[metrics.current], uint64_t(1));
+    add(metrics.causes[size_t(cause)], uint64_t(1));
+}
+
+void count_bytes(int64_t delta) {
+    add(local_metrics().bytes, delta);
+}
+
+void count_packed(int64_t queues, int64_t bytes) {
+    thread_metrics &metrics = local_metrics();
+
+    add(metrics.packed_queues, queues);
+    add(metrics.packed_bytes, bytes);
+}
+
+// takes bytes out of the budget for a thread about to store them;
+// false if the limit does not allow that, unless forced
+bool take_budget(uint64_t bytes, bool force) {
+    thread_metrics &metrics = local_metrics();
+
+    if (metrics.credit >= bytes) {
+        metrics.credit -= bytes;
+        return true;
+    }
+
+    const uint64_t needed = bytes - metrics.credit;
+    const uint64_t limit = global_byte_limit.load(memory_order_relaxed);
+
+    // a whole batch is taken if possible, only the missing part otherwise
+    for (const uint64_t grab : {needed + budget_batch, needed}) {
+        const uint64_t before = budget_taken.fetch_add(grab, memory_order_relaxed);
+
+        if (force || limit == 0 || before + grab <= limit) {
+            metrics.credit = metrics.credit + grab - bytes;
+            return true;
+        }
+
+        budget_taken.fetch_sub(grab, memory_order_relaxed);
+    }
+
+    return false;
+}
+
+// gives bytes that are no longer stored back to the budget
+void return_budget(uint64_t bytes) {
+    thread_metrics &metrics = local_metrics();
+
+    metrics.credit += bytes;
+    if (metrics.credit > 2 * budget_batch) {
+        budget_taken.fetch_sub(metrics.credit - budget_batch, memory_order_relaxed);
+        metrics.credit = budget_batch;
+    }
+}
+
+// called for the bytes of queues that are deleted as a whole
+void release_bytes(size_t bytes) {
+    count_bytes(-static_cast<int64_t>(bytes));
+    return_budget(bytes);
+}
+
+// idle queue whose elements are packed into a single block, compressed
+// when zlib is available; the first access unpacks them into storage of
+// their kind, to which everything is forwarded from then on
+class compressed_storage final : public storage {
+public:
+    // packs the elements of source of the given kind
+    compressed_storage(const storage &source, unsigned int flags)
+        : kind_flags(flags), count(source.size()) {
+        vector<string_view> strs(count);
+        size_t total = count * sizeof(uint32_t);
+
+        source.get_views(0, count, strs.data());
+        for (string_view str : strs)
+            total += str.size();
+
+        // lengths first, then the bytes of all strings
+        unique_ptr<char[]> raw(new char[total]);
+        char *next = raw.get();
+
+        for (string_view str : strs) {
+            const uint32_t len = static_cast<uint32_t>(str.size());
+
+            memcpy(next, &len, sizeof(len));
+            next += sizeof(len);
+        }
+        for (string_view str : strs) {
+            memcpy(next, str.data(), str.size());
+            next += str.size();
+        }
+
+        raw_size = total;
+#ifdef STRQUEUE_ZLIB
+        uLongf length = compressBound(total);
+        unique_ptr<char[]> packed(new char[length]);
+
+        if (compress2(reinterpret_cast<Bytef*>(packed.get()), &length,
+                        reinterpret_cast<const Bytef*>(raw.get()), total,
+                        Z_BEST_SPEED) == Z_OK && length < total) {
+            block.reset(new char[length]);
+            memcpy(block.get(), packed.get(), length);
+            block_size = length;
+        }
+#endif
+        if (!block) {
+            block = move(raw);
+            block_size = total;
+        }
+
+        count_packed(1, static_cast<int64_t>(block_size));
+    }
+
+    ~compressed_storage(void) {
+        if (block)
+            count_packed(-1, -static_cast<int64_t>(block_size));
+    }
+
+    // strings longer than the lengths in the block can hold are not packed
+    static bool packable(const storage &source) {
+        for (size_t i = 0; i < source.size(); ++i)
+            if (source.at(i).size() > numeric_limits<uint32_t>::max())
+                return false;
+
+        return true;
+    }
+
+    size_t size(void) const override {
+        const storage *res = unpacked.load(memory_order_acquire);
+        return res != nullptr ? res->size() : count;
+    }
+
+    string_view at(size_t position) const override {
+        return resident().at(position);
+    }
+
+    bool insert(size_t position, string_view str) override {
+        return resident().insert(position, str);
+    }
+
+    bool insert_moved(size_t position, string &&str) override {
+        return resident().insert_moved(position, move(str));
+    }
+
+    bool erase(size_t position) override {
+        return resident().erase(position);
+    }
+
+    bool clear(void) override {
+        return resident().clear();
+    }
+
+    bool insert_range(size_t position, const string_view *strs, size_t n) override {
+        return resident().insert_range(position, strs, n);
+    }
+
+    bool erase_range(size_t position, size_t n) override {
+        return resident().erase_range(position, n);
+    }
+
+    void get_range(size_t position, size_t n, const char **out) const override {
+        resident().get_range(position, n, out);
+    }
+
+    void get_views(size_t position, size_t n, string_view *out) const override {
+        resident().get_views(position, n, out);
+    }
+
+    size_t find(string_view str, size_t start) const override {
+        return resident().find(str, start);
+    }
+
+    void assign(const string_view *strs, size_t n) override {
+        resident().assign(strs, n);
+    }
+
+    void reserve(size_t n, size_t needed) override {
+        resident().reserve(n, needed);
+    }
+
+    void shrink_to_fit(void) override {
+        resident().shrink_to_fit();
+    }
+
+    optional<unsigned int> kind(void) const override {
+        return kind_flags;
+    }
+
+    unique_ptr<storage> clone(void) const override {
+        return resident().clone();
+    }
+
+    // packed elements are not unpacked just to be compared
+    const void *shared_elements(void) const override {
+        const storage *res = unpacked.load(memory_order_acquire);
+
+        return res != nullptr ? res->shared_elements() : nullptr;
+    }
+
+    // calls visit with views of all n elements, which are read from
+    // the block if they have not been unpacked and are not NUL-terminated
+    // then; nothing is unpacked, so that a queue is not taken out of its
+    // compressed form just to be read once
+    template<typename Visit>
+    void visit_elements(Visit visit) const {
+        lock_guard<pack_mutex> guard(mutex);
+
+        if (const storage *res = unpacked.load(memory_order_relaxed)) {
+            vector<string_view> strs(res->size());
+
+            res->get_views(0, strs.size(), strs.data());
+            visit(strs.data(), strs.size());
+            return;
+        }
+
+        read_block(visit);
+    }
+
+    // the unpacked elements, nullptr if they have not been accessed
+    unique_ptr<storage> take_unpacked(void) {
+        unpacked.store(nullptr, memory_order_relaxed);
+        return move(owner);
+    }
+
+private:
+    const unsigned int kind_flags;
+    const size_t count;
+    size_t raw_size = 0, block_size = 0;
+    // freed once unpacked, under the mutex
+    mutable unique_ptr<char[]> block;
+    mutable pack_mutex mutex;
+    mutable unique_ptr<storage> owner;
+    // owner, published once it is complete to readers holding
+    // the queue only in shared mode
+    mutable atomic<storage*> unpacked{nullptr};
+
+    storage &resident(void) const {
+        storage *res = unpacked.load(memory_order_acquire);
+
+        if (res != nullptr)
+            return *res;
+
+        lock_guard<pack_mutex> guard(mutex);
+
+        res = unpacked.load(memory_order_relaxed);
+        if (res == nullptr) {
+            owner = unpack();
+            res = owner.get();
+            unpacked.store(res, memory_order_release);
+
+            count_packed(-1, -static_cast<int64_t>(block_size));
+            add(local_metrics().unpacks, uint64_t(1));
+            block.reset();
+        }
+
+        return *res;
+    }
+
+    unique_ptr<storage> unpack(void) const {
+        auto res = make_storage(kind_flags);
+
+        read_block([&](const string_view *strs, size_t n) { res->assign(strs, n); });
+        return res;
+    }
+
+    // calls visit with views of the elements in the block
+    template<typename Visit>
+    void read_block(Visit visit) const {
+        unique_ptr<char[]> inflated;
+        const char *raw = block.get();
+
+#ifdef STRQUEUE_ZLIB
+        if (block_size < raw_size) {
+            uLongf length = raw_size;
+
+            inflated.reset(new char[raw_size]);
+            const int res = uncompress(reinterpret_cast<Bytef*>(inflated.get()), &length,
+                                        reinterpret_cast<const Bytef*>(raw), block_size);
+
+            assert(res == Z_OK && length == raw_size);
+            (void)res;
+            raw = inflated.get();
+        }
+#endif
+
+        vector<string_view> strs(count);
+        const char *bytes = raw + count * sizeof(uint32_t);
+
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t len;
+
+            memcpy(&len, raw + i * sizeof(len), sizeof(len));
+            strs[i] = string_view(bytes, len);
+            bytes += len;
+        }
+
+        visit(strs.data(), strs.size());
+    }
+};
+
+// queues smaller than this are not worth compressing
+constexpr size_t compress_min_size = 64;
+
+// whether queues that are deleted or cleared hand their elements over to
+// a background thread instead of freeing them; always off without
+// thread safety
+atomic<bool> deferred_reclaim{false};
+
+// queues smaller than this are quicker to free than to hand over
+constexpr size_t deferred_min_size = 256;
+
+#ifdef STRQUEUE_THREAD_SAFE
+// background thread freeing storage that no queue uses any more,
+// started when it is first needed
+class reclaimer {
+public:
+    reclaimer(void) = default;
+
+    reclaimer(const reclaimer &) = delete;
+
+    reclaimer &operator=(const reclaimer &) = delete;
+
+    ~reclaimer(void) {
+        {
+            lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+
+        wake.notify_one();
+        if (thread.joinable())
+            thread.join();
+    }
+
+    void defer(unique_ptr<storage> garbage) {
+        {
+            lock_guard<std::mutex> guard(mutex);
+
+            if (!thread.joinable())
+                thread = std::thread([this] { work(); });
+            pending.push_back(move(garbage));
+        }
+
+        wake.notify_one();
+    }
+
+    // returns once everything deferred so far has been freed
+    void sync(void) {
+        unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return pending.empty() && !busy; });
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    vector<unique_ptr<storage>> pending;
+    // whether the thread is freeing storage taken from pending
+    bool busy = false;
+    bool stopping = false;
+    std::thread thread;
+
+    // frees pending storage in batches, and what is left before stopping
+    void work(void) {
+        unique_lock<std::mutex> lock(mutex);
+
+        for (;;) {
+            wake.wait(lock, [this] { return stopping || !pending.empty(); });
+
+            if (pending.empty())
+                return;
+
+            vector<unique_ptr<storage>> batch;
+            batch.swap(pending);
+            busy = true;
+            lock.unlock();
+
+            batch.clear();
+
+            lock.lock();
+            busy = false;
+            idle.notify_all();
+        }
+    }
+};
+
+reclaimer &get_reclaimer(void) {
+    static reclaimer instance;
+    return instance;
+}
+#endif
+
+// number of occurrences of every element of an indexed queue; keyed by
+// views of copies owned by the entries, so that lookups allocate nothing
+class element_counts {
+public:
+    size_t count(string_view str) const {
+        const auto it = counts.find(str);
+        return it == counts.end() ? 0 : it->second.count;
+    }
+
+    void add(string_view str) {
+        const auto it = counts.find(str);
+
+        if (it != counts.end()) {
+            ++it->second.count;
+            return;
+        }
+
+        unique_ptr<char[]> key(new char[str.size()]);
+        memcpy(key.get(), str.data(), str.size());
+
+        const string_view view(key.get(), str.size());
+        counts.emplace(view, counted{move(key), 1});
+    }
+
+    void remove(string_view str) {
+        const auto it = counts.find(str);
+
+        // every element has been counted
+        assert(it != counts.end());
+        if (it == counts.end())
+            return;
+
+        if (--it->second.count == 0)
+            counts.erase(it);
+    }
+
+    size_t size(void) const {
+        return counts.size();
+    }
+
+    void clear(void) {
+        counts.clear();
+    }
+
+    void reserve(size_t n) {
+        counts.reserve(n);
+    }
+
+    void shrink_to_fit(void) {
+        counts.rehash(0);
+    }
+
+private:
+    struct counted {
+        unique_ptr<char[]> key;
+        size_t count;
+    };
+
+    unordered_map<string_view, counted> counts;
+};
+
+// a queue together with the lock guarding it; all modifications go
+// through here to keep the summary of the contents up to date
+class queue_entry {
+public:
+    mutable registry_mutex mutex;
+
+    // FIFO queues have a ring in addition to their (empty) storage
+    explicit queue_entry(unique_ptr<storage> elems, unique_ptr<fifo_ring> fifo = nullptr)
+        : owned(move(elems)), elements(owned.get()), ring(move(fifo)) {
+        // storage may come with elements, as opened persistent queues do
+        if (!elements->load_summary(hash, bytes)) {
+            for (size_t i = 0; i < elements->size(); ++i) {
+                hash += element_hash(elements->at(i));
+                bytes += elements->at(i).size();
+            }
+        }
+
+        count_bytes(bytes);
+        take_budget(bytes, true);
+    }
+
+    // a copy of another queue, whose hash and byte count are already known
+    queue_entry(unique_ptr<storage> elems, uint64_t content, size_t length)
+        : owned(move(elems)), elements(owned.get()), hash(content), bytes(length) {
+        count_bytes(bytes);
+        take_budget(bytes, true);
+    }
+
+    // a new queue of the given kind, starting out in small_storage inside
+    // the entry, so that it needs no allocation of its own
+    explicit queue_entry(unsigned int kind)
+        : small(std::in_place, kind), elements(&*small) {}
+
+    // same as above, with room for count strings of length bytes in total
+    queue_entry(unsigned int kind, size_t count, size_t length) : queue_entry(kind) {
+        reserve(count, length);
+    }
+
+    queue_entry(const queue_entry &) = delete;
+
+    queue_entry &operator=(const queue_entry &) = delete;
+
+    ~queue_entry(void) {
+        elements->save_hash(hash);
+    }
+
+    // nullptr for queues with positional access
+    fifo_ring *fifo(void) const {
+        return ring.get();
+    }
+
+    // the ring, kept alive by the result after the queue is deleted
+    shared_ptr<fifo_ring> share_fifo(void) const {
+        return ring;
+    }
+
+    const storage &contents(void) const {
+        return *elements;
+    }
+
+    size_t size(void) const {
+        return ring ? ring->size() : elements->size();
+    }
+
+    string_view at(size_t position) const {
+        return elements->at(position);
+    }
+
+    void get_range(size_t position, size_t count, const char **out) const {
+        elements->get_range(position, count, out);
+    }
+
+    void get_views(size_t position, size_t count, string_view *out) const {
+        elements->get_views(position, count, out);
+    }
+
+    // order-independent hash of the elements, equal queues have equal hashes
+    uint64_t content_hash(void) const {
+        return hash;
+    }
+
+    // number of modifications so far, views of elements taken
+    // at the same epoch as now are still valid
+    unsigned long epoch(void) const {
+        return modifications;
+    }
+
+    // total length of the elements
+    size_t byte_size(void) const {
+        return bytes;
+    }
+
+    // 0 removes the limit, elements above a lowered limit are kept
+    void set_byte_limit(size_t new_limit) {
+        limit = new_limit;
+    }
+
+    // whether the queue keeps an index of its elements
+    bool indexed(void) const {
+        return index != nullptr;
+    }
+
+    // creating the index takes O(n) time, afterwards it is kept up to
+    // date by every modification
+    void set_indexed(bool enabled) {
+        if (!enabled) {
+            index.reset();
+            return;
+        }
+
+        if (index)
+            return;
+
+        auto res = make_unique<element_counts>();
+
+        for (size_t i = 0; i < elements->size(); ++i)
+            res->add(elements->at(i));
+        index = move(res);
+    }
+
+    // O(1) with an index, a scan otherwise
+    bool contains(string_view str) const {
+        if (index)
+            return index->count(str) != 0;
+
+        return elements->find(str, 0) != STRQUEUE_NOT_FOUND;
+    }
+
+    // the index only tells whether there is anything to look for,
+    // positions shift with every insertion and are found by a scan
+    size_t find(string_view str, size_t start) const {
+        if (index && index->count(str) == 0)
+            return STRQUEUE_NOT_FOUND;
+
+        return elements->find(str, start);
+    }
+
+    // number of calls that read the queue
+    unsigned long read_count(void) const {
+        return reads;
+    }
+
+    // called by every function reading the queue, also under a shared lock
+    void count_read(void) const {
+        ++reads;
+    }
+
+    // the insertion functions return why the queue is left unchanged:
+    // over_limit if the strings do not fit within the byte limits,
+    // rejected if the backend cannot store them; nothing once inserted
+    optional<failure> insert(size_t position, string_view str) {
+        if (!reserve(str.size()))
+            return failure::over_limit;
+
+        // str may be an element of this queue, which the insertion moves;
+        // a failed insertion moves nothing, so it is still valid then
+        const uint64_t added = element_hash(str);
+
+        index_add(str);
+        if (!elements->insert(position, str)) {
+            index_remove(str);
+            return_budget(str.size());
+            return failure::rejected;
+        }
+        hash += added;
+        account(str.size());
+        ++modifications;
+        return std::nullopt;
+    }
+
+    optional<failure> insert_moved(size_t position, string &&str) {
+        const size_t len = str.size();
+
+        if (!reserve(len))
+            return failure::over_limit;
+
+        const uint64_t added = element_hash(str);
+
+        // str is only taken over by a successful insertion
+        index_add(str);
+        if (!elements->insert_moved(position, move(str))) {
+            index_remove(str);
+            return_budget(len);
+            return failure::rejected;
+        }
+        hash += added;
+        account(len);
+        ++modifications;
+        return std::nullopt;
+    }
+
+    optional<failure> insert_range(size_t position, const string_view *strs, size_t n) {
+        int64_t added = 0;
+
+        for (size_t i = 0; i < n; ++i)
+            added += strs[i].size();
+
+        if (!reserve(added))
+            return failure::over_limit;
+
+        uint64_t added_hash = 0;
+
+        for (size_t i = 0; i < n; ++i) {
+            added_hash += element_hash(strs[i]);
+            index_add(strs[i]);
+        }
+        if (!elements->insert_range(position, strs, n)) {
+            for (size_t i = 0; i < n; ++i)
+                index_remove(strs[i]);
+            return_budget(added);
+            return failure::rejected;
+        }
+        hash += added_hash;
+        account(added);
+        ++modifications;
+        return std::nullopt;
+    }
+
+    // the removal functions return false, leaving the queue unchanged,
+    // if the backend cannot store the change
+    bool erase(size_t position) {
+        const string_view str = elements->at(position);
+        const size_t len = str.size();
+        const uint64_t removed = element_hash(str);
+
+        // str is valid until the element is gone
+        index_remove(str);
+        if (!elements->erase(position)) {
+            index_add(str);
+            return false;
+        }
+        hash -= removed;
+        account(-static_cast<int64_t>(len));
+        ++modifications;
+        return true;
+    }
+
+    bool erase_range(size_t position, size_t count) {
+        int64_t removed = 0;
+        uint64_t removed_hash = 0;
+
+        for (size_t i = 0; i < count; ++i) {
+            const string_view str = elements->at(position + i);
+
+            removed_hash += element_hash(str);
+            index_remove(str);
+            removed += str.size();
+        }
+        if (!elements->erase_range(position, count)) {
+            for (size_t i = 0; i < count; ++i)
+                index_add(elements->at(position + i));
+            return false;
+        }
+        hash -= removed_hash;
+        account(-removed);
+        ++modifications;
+        return true;
+    }
+
+    // hands the elements over to the reclaimer thread in O(1) if deferred
+    // reclamation is on and they are worth it, leaving the queue empty;
+    // returns false for FIFO and persistent queues, which keep them
+    bool retire(void) {
+#ifdef STRQUEUE_THREAD_SAFE
+        const optional<unsigned int> kind = elements->kind();
+
+        if (!deferred_reclaim.load(memory_order_relaxed) || !kind || ring
+                || elements->size() < deferred_min_size)
+            return false;
+
+        unique_ptr<storage> garbage;
+
+        if (small) {
+            garbage = small->release_large();
+        }
+        else {
+            garbage = make_storage(*kind);
+            owned.swap(garbage);
+            elements = owned.get();
+            packed = nullptr;
+        }
+
+        hash = 0;
+        account(-static_cast<int64_t>(bytes));
+        if (index)
+            index->clear();
+        ++modifications;
+
+        get_reclaimer().defer(move(garbage));
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // elements of large queues may be freed by the reclaimer thread;
+    // returns false, leaving the queue unchanged, if the backend cannot
+    // store the change or the queue is an SPSC FIFO one, whose ring only
+    // its consumer may pop
+    bool clear(void) {
+        if (ring && ring->single_consumer())
+            return false;
+
+        if (retire())
+            return true;
+
+        // packed elements are dropped without being unpacked
+        if (packed) {
+            owned = make_storage(*packed->kind());
+            elements = owned.get();
+            packed = nullptr;
+        }
+        else if (!elements->clear()) {
+            return false;
+        }
+
+        hash = 0;
+        account(-static_cast<int64_t>(bytes));
+        if (index)
+            index->clear();
+        ++modifications;
+
+        if (ring)
+            ring->drain();
+        return true;
+    }
+
+    // room for count more strings of length bytes in total, without the
+    // NULs; may move the elements, so it counts as a modification
+    void reserve(size_t count, size_t length) {
+        elements->reserve(count, length + count);
+        if (index)
+            index->reserve(index->size() + count);
+        ++modifications;
+    }
+
+    void shrink_to_fit(void) {
+        elements->shrink_to_fit();
+        if (index)
+            index->shrink_to_fit();
+        ++modifications;
+    }
+
+    // whether strqueue_compress_idle may compress the queue
+    void set_compressible(bool enabled) {
+        compressible = enabled;
+    }
+
+    bool compressed(void) const {
+        return packed != nullptr;
+    }
+
+    // calls visit with views of all n elements, without unpacking a
+    // compressed queue; the views are NUL-terminated unless it is one
+    template<typename Visit>
+    void visit_elements(Visit visit) const {
+        if (packed) {
+            packed->visit_elements(visit);
+            return;
+        }
+
+        vector<string_view> strs(elements->size());
+
+        elements->get_views(0, strs.size(), strs.data());
+        visit(static_cast<const string_view*>(strs.data()), strs.size());
+    }
+
+    // called by strqueue_compress_idle: compresses the queue if it may be
+    // and nothing has read or modified it since the previous call, which
+    // invalidates views of its elements like a modification does; the
+    // elements of a compressed queue accessed since then are taken out
+    // of it; returns true if the queue has been compressed
+    bool compress_if_idle(void) {
+        if (packed) {
+            if (auto res = packed->take_unpacked()) {
+                owned = move(res);
+                elements = owned.get();
+                packed = nullptr;
+            }
+        }
+
+        const unsigned long activity = read_count() + modifications;
+        const bool idle = (activity == last_activity);
+
+        last_activity = activity;
+
+        if (!idle || !compressible || packed || ring || elements->size() < compress_min_size)
+            return false;
+
+        const optional<unsigned int> kind = elements->kind();
+
+        if (!kind || !compressed_storage::packable(*elements))
+            return false;
+
+        auto res = make_unique<compressed_storage>(*elements, *kind);
+
+        packed = res.get();
+        owned = move(res);
+        elements = owned.get();
+        small.reset();
+        ++modifications;
+        ++last_activity;
+        return true;
+    }
+
+private:
+    optional<small_storage> small;
+    unique_ptr<storage> owned;
+    // either of the above
+    storage *elements;
+    // owned, if the queue is compressed
+    compressed_storage *packed = nullptr;
+    bool compressible = false;
+    // reads and modifications up to the last strqueue_compress_idle
+    unsigned long last_activity = numeric_limits<unsigned long>::max();
+    // shared with the handles of strqueue_fifo_acquire
+    shared_ptr<fifo_ring> ring;
+    uint64_t hash = 0;
+    size_t bytes = 0;
+    // most bytes the elements may take up, 0 if there is no limit
+    size_t limit = 0;
+    unsigned long modifications = 0;
+    mutable stat_counter reads{0};
+    // set if the queue is indexed
+    unique_ptr<element_counts> index;
+
+    void index_add(string_view str) {
+        if (index)
+            index->add(str);
+    }
+
+    void index_remove(string_view str) {
+        if (index)
+            index->remove(str);
+    }
+
+    // checks the limits for added bytes, which are taken out of
+    // the global budget if they fit
+    bool reserve(size_t added) const {
+        if (limit != 0 && (bytes > limit || limit - bytes < added))
+            return false;
+
+        return take_budget(added, false);
+    }
+
+    // inserted bytes have been reserved, removed ones go back to the budget
+    void account(int64_t delta) {
+        bytes += delta;
+        count_bytes(delta);
+
+        if (delta < 0)
+            return_budget(-delta);
+    }
+
+    // string hash passed through a finaliser, so that summing
+    // the hashes of elements does not cancel out their bits
+    static uint64_t element_hash(string_view str) {
+        uint64_t h = std::hash<string_view>()(str);
+
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9u;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebu;
+        h ^= h >> 31;
+
+        return h;
+    }
+};
+
+constexpr unsigned log2_of(size_t n) {
+    return n <= 1 ? 0 : 1 + log2_of(n / 2);
+}
+
+// registry policies, each a part of the registry guarded by a single lock,
+// padded to a cache line so that neighbouring shards do not share one
+
+// queues live in slots of fixed-size chunks, which never move; an ID is
+// made of the generation of its slot in the upper 32 bits, then the slot
+// index and the shard number in the lowest bits; deleting a queue bumps
+// the generation, so its ID stays invalid even after the slot has been reused
+template<typename Locking>
+struct alignas(64) slot_shard {
+    mutable typename Locking::registry_mutex mutex;
+
+    slot_shard(void) = default;
+
+    slot_shard(const slot_shard &) = delete;
+
+    slot_shard &operator=(const slot_shard &) = delete;
+
+    queue_entry *find(unsigned long id) {
+        const size_t index = index_of(id);
+
+        if (index >= used_slots)
+            return nullptr;
+
+        slot &s = slot_at(index);
+        if (s.generation != generation_of(id) || !s.entry)
+            return nullptr;
+
+        return &*s.entry;
+    }
+
+    // stores a new queue made of args and returns its ID,
+    // shard_index is the position of this shard in the registry
+    template<typename... Args>
+    unsigned long emplace(size_t shard_index, Args &&...args) {
+        size_t index = free_head;
+
+        if (index != no_slot) {
+            free_head = slot_at(index).next_free;
+        }
+        else {
+            index = used_slots++;
+
+            // check if there are valid IDs
+            assert(index < (size_t(1) << index_bits));
+
+            if (index % chunk_size == 0)
+                chunks.push_back(make_unique<slot[]>(chunk_size));
+        }
+
+        slot &s = slot_at(index);
+        s.entry.emplace(std::forward<Args>(args)...);
+        ++live;
+
+        return (static_cast<unsigned long>(s.generation) << 32) 
+                | (index << shard_bits) | shard_index;
+    }
+
+    // returns false if there is no such queue
+    bool erase(unsigned long id) {
+        if (find(id) == nullptr)
+            return false;
+
+        const size_t index = index_of(id);
+        slot &s = slot_at(index);
+
+        s.entry.reset();
+        --live;
+
+        // a slot whose generations ran out is never reused
+        if (++s.generation != 0) {
+            s.next_free = free_head;
+            free_head = index;
+        }
+
+        return true;
+    }
+
+    size_t queue_count(void) const {
+        return live;
+    }
+
+    // calls f(id, queue) for every queue, shard_index as in emplace
+    template<typename F>
+    void for_each(size_t shard_index, F f) {
+        for (size_t index = 0; index < used_slots; ++index) {
+            slot &s = slot_at(index);
+
+            if (s.entry)
+                f((static_cast<unsigned long>(s.generation) << 32) 
+                    | (index << shard_bits) | shard_index, *s.entry);
+        }
+    }
+
+    // replaces every queue with the given ones, which keep their IDs
+    void restore(vector<pair<unsigned long, unique_ptr<storage>>> &queues) {
+        chunks.clear();
+        used_slots = 0;
+        free_head = no_slot;
+        live = 0;
+
+        for (auto &[id, elements] : queues) {
+            const size_t index = index_of(id);
+
+            for (; used_slots <= index; ++used_slots)
+                if (used_slots % chunk_size == 0)
+                    chunks.push_back(make_unique<slot[]>(chunk_size));
+
+            slot &s = slot_at(index);
+            s.generation = generation_of(id);
+            live += !s.entry;
+            s.entry.emplace(move(elements));
+        }
+
+        // slots between the restored ones are free
+        for (size_t index = used_slots; index-- > 0;) {
+            if (!slot_at(index).entry) {
+                slot_at(index).next_free = free_head;
+                free_head = index;
+            }
+        }
+    }
+
+private:
+    static constexpr unsigned shard_bits = log2_of(Locking::shard_count);
+    static constexpr unsigned index_bits = 32 - shard_bits;
+    static constexpr size_t chunk_size = 256;
+    static constexpr size_t no_slot = numeric_limits<size_t>::max();
+
+    struct slot {
+        optional<queue_entry> entry;
+        uint32_t generation = 1;
+        // next slot on the free list
+        size_t next_free = no_slot;
+    };
+
+    vector<unique_ptr<slot[]>> chunks;
+    size_t used_slots = 0;
+    size_t free_head = no_slot;
+    // number of slots holding a queue
+    size_t live = 0;
+
+    static size_t index_of(unsigned long id) {
+        return (id & 0xffffffffu) >> shard_bits;
+    }
+
+    static uint32_t generation_of(unsigned long id) {
+        return static_cast<uint32_t>(id >> 32);
+    }
+
+    slot &slot_at(size_t index) {
+        return chunks[index / chunk_size][index % chunk_size];
+    }
+};
+
+// queues in a hash map keyed by consecutive IDs
+template<typename Locking>
+struct alignas(64) hash_shard {
+    mutable typename Locking::registry_mutex mutex;
+
+    queue_entry *find(unsigned long id) {
+        auto queue_it = queues.find(id);
+        return queue_it == queues.end() ? nullptr : &queue_it->second;
+    }
+
+    template<typename... Args>
+    void emplace(unsigned long id, Args &&...args) {
+        queues.try_emplace(id, std::forward<Args>(args)...);
+    }
+
+    // returns false if there is no such queue
+    bool erase(unsigned long id) {
+        return queues.erase(id) > 0;
+    }
+
+    size_t queue_count(void) const {
+        return queues.size();
+    }
+
+    // calls f(id, queue) for every queue
+    template<typename F>
+    void for_each(size_t, F f) {
+        for (auto &[id, queue] : queues)
+            f(id, queue);
+    }
+
+    // replaces every queue with the given ones, which keep their IDs
+    void restore(vector<pair<unsigned long, unique_ptr<storage>>> &queues_to_restore) {
+        queues.clear();
+
+        for (auto &[id, elements] : queues_to_restore) {
+            queues.erase(id);
+            queues.try_emplace(id, move(elements));
+        }
+    }
+
+private:
+    unordered_map<unsigned long, queue_entry> queues;
+};
+
+#ifdef STRQUEUE_SLOT_REGISTRY
+constexpr bool slot_registry = true;
+#else
+constexpr bool slot_registry = false;
+#endif
+
+using shard = conditional_t<slot_registry, slot_shard<locking>, hash_shard<locking>>;
+
+static_assert(!slot_registry || sizeof(unsigned long) >= 8, "slot registry needs 64-bit IDs");
+
+// equality of two queues: the sizes and content hashes answer most
+// queries right away, only likely equal queues are compared elementwise
+bool queues_equal(const queue_entry &q1, const queue_entry &q2) {
+    // the contents of FIFO queues are not looked at
+    const storage &s1 = q1.contents(), &s2 = q2.contents();
+
+    if (&q1 == &q2)
+        return true;
+
+    if (s1.size() != s2.size() || q1.content_hash() != q2.content_hash())
+        return false;
+
+    // a clone shares its elements until either queue is modified
+    if (s1.same_as(s2))
+        return true;
+
+    for (size_t i = 0; i < s1.size(); ++i)
+        if (!equal_strings(s1.at(i), s2.at(i)))
+            return false;
+
+    return true;
+}
+
+// prevents static initialisation order fiasco
+id_counter &get_cnt(void) {
+    static id_counter cnt(0);
+    return cnt;
+}
+
+// purpose same as above
+array<shard, shard_count> &get_shards(void) {
+    static array<shard, shard_count> shards;
+    return shards;
+}
+
+// returns the shard responsible for a given ID
+shard &get_shard(unsigned long id) {
+    return get_shards()[id % shard_count];
+}
+
+// returns an empty queue for the sake of queue lexicographical comparison
+queue_entry &get_empty_queue(void) {
+    static queue_entry empty_queue(make_unique<deque_storage>());
+    return empty_queue;
+}
+
+// locks two mutexes in shared mode, always in the same order
+// to avoid deadlocks, and the same mutex only once
+pair<shared_lock<registry_mutex>, shared_lock<registry_mutex>>
+lock_both_shared(registry_mutex &m1, registry_mutex &m2) {
+    if (&m1 == &m2)
+        return {shared_lock<registry_mutex>(m1), shared_lock<registry_mutex>()};
+
+    if (less<registry_mutex*>()(&m2, &m1)) {
+        shared_lock<registry_mutex> first(m2);
+        return {shared_lock<registry_mutex>(m1), move(first)};
+    }
+
+    shared_lock<registry_mutex> first(m1);
+    return {move(first), shared_lock<registry_mutex>(m2)};
+}
+
+#ifdef STRQUEUE_THREAD_SAFE
+// threads sharing out the iterations of loops: a loop is cut into chunks
+// which the thread that started it and every idle pool thread take one
+// at a time, so that expensive iterations do not hold up the rest
+class thread_pool {
+public:
+    explicit thread_pool(unsigned int threads) {
+        for (unsigned int i = 0; i < threads; ++i)
+            workers.emplace_back([this] { work(); });
+    }
+
+    thread_pool(const thread_pool &) = delete;
+
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    ~thread_pool(void) {
+        {
+            lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+
+        wake.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    // calls body(i) for every i < n, returns once all calls have returned
+    template<typename F>
+    void run(size_t n, const F &body) {
+        loop l;
+
+        l.size = n;
+        l.chunk = std::max<size_t>(1, n / (8 * (workers.size() + 1)));
+        l.body = &body;
+        l.call = [](const void *f, size_t i) { (*static_cast<const F*>(f))(i); };
+
+        // not worth waking anyone up
+        if (workers.empty() || n <= l.chunk) {
+            for (size_t i = 0; i < n; ++i)
+                body(i);
+            return;
+        }
+
+        unique_lock<std::mutex> lock(mutex);
+        loops.push_back(&l);
+        lock.unlock();
+        wake.notify_all();
+
+        take_chunks(l);
+
+        lock.lock();
+        remove(l);
+        finished.wait(lock, [&l] { return l.helpers == 0; });
+    }
+
+private:
+    struct loop {
+        size_t size;
+        size_t chunk;
+        const void *body;
+        void (*call)(const void*, size_t);
+        // first iteration not taken yet
+        atomic<size_t> next{0};
+        // pool threads taking chunks of the loop, guarded by mutex
+        unsigned int helpers = 0;
+    };
+
+    std::mutex mutex;
+    std::condition_variable wake, finished;
+    // loops that may have chunks left
+    deque<loop*> loops;
+    bool stopping = false;
+    vector<std::thread> workers;
+
+    static void take_chunks(loop &l) {
+        for (;;) {
+            const size_t first = l.next.fetch_add(l.chunk, memory_order_relaxed);
+
+            if (first >= l.size)
+                return;
+
+            const size_t last = std::min(first + l.chunk, l.size);
+
+            for (size_t i = first; i < last; ++i)
+                l.call(l.body, i);
+        }
+    }
+
+    // called with mutex locked once all chunks of l have been taken
+    void remove(loop &l) {
+        const auto it = std::find(loops.begin(), loops.end(), &l);
+
+        if (it != loops.end())
+            loops.erase(it);
+    }
+
+    void work(void) {
+        unique_lock<std::mutex> lock(mutex);
+
+        for (;;) {
+            wake.wait(lock, [this] { return stopping || !loops.empty(); });
+
+            if (stopping)
+                return;
+
+            loop &l = *loops.front();
+            ++l.helpers;
+            lock.unlock();
+
+            take_chunks(l);
+
+            lock.lock();
+            remove(l);
+            if (--l.helpers == 0)
+                finished.notify_all();
+        }
+    }
+};
+
+// one thread less than there are processors, the calling thread
+// being the last one
+thread_pool &get_pool(void) {
+    // pool threads count metrics too, so the registry has to outlive them
+    get_metrics_registry();
+
+    static thread_pool pool(std::max(std::thread::hardware_concurrency(), 1u) - 1);
+    return pool;
+}
+#else
+// without thread safety loops run on the calling thread
+struct thread_pool {
+    template<typename F>
+    void run(size_t n, const F &body) {
+        for (size_t i = 0; i < n; ++i)
+            body(i);
+    }
+};
+
+thread_pool &get_pool(void) {
+    static thread_pool pool;
+    return pool;
+}
+#endif
+
+// one pass of idle compression over all queues, shards shared out among
+// the pool; queues locked at the moment are in use and are skipped
+size_t compress_idle_queues(void) {
+    auto &shards = get_shards();
+    atomic<size_t> res{0};
+
+    get_pool().run(shard_count, [&](size_t i) {
+        shared_lock<registry_mutex> shard_lock(shards[i].mutex);
+
+        shards[i].for_each(i, [&](unsigned long, queue_entry &queue) {
+            unique_lock<registry_mutex> lock(queue.mutex, std::try_to_lock);
+
+            if (lock.owns_lock() && queue.compress_if_idle())
+                res.fetch_add(1, memory_order_relaxed);
+        });
+    });
+
+    return res.load(memory_order_relaxed);
+}
+
+#ifdef STRQUEUE_THREAD_SAFE
+// background thread compressing idle queues every interval milliseconds,
+// started when an interval is first set and stopped by setting 0
+class idle_compressor {
+public:
+    idle_compressor(void) = default;
+
+    idle_compressor(const idle_compressor &) = delete;
+
+    idle_compressor &operator=(const idle_compressor &) = delete;
+
+    ~idle_compressor(void) {
+        set_interval(0);
+    }
+
+    void set_interval(unsigned long milliseconds) {
+        lock_guard<std::mutex> control_guard(control);
+
+        {
+            lock_guard<std::mutex> guard(mutex);
+            interval = milliseconds;
+        }
+
+        wake.notify_one();
+        if (milliseconds == 0 && thread.joinable())
+            thread.join();
+        else if (milliseconds != 0 && !thread.joinable())
+            thread = std::thread([this] { work(); });
+    }
+
+private:
+    // control serialises starting and stopping the thread
+    std::mutex control, mutex;
+    std::condition_variable wake;
+    unsigned long interval = 0;
+    std::thread thread;
+
+    void work(void) {
+        unique_lock<std::mutex> lock(mutex);
+
+        for (;;) {
+            const unsigned long current = interval;
+
+            if (current == 0)
+                return;
+
+            // a new interval starts the wait over
+            if (wake.wait_for(lock, std::chrono::milliseconds(current),
+                                [&] { return interval != current; }))
+                continue;
+
+            lock.unlock();
+            compress_idle_queues();
+            lock.lock();
+        }
+    }
+};
+
+idle_compressor &get_idle_compressor(void) {
+    // the registry and the pool have to outlive the thread
+    get_shards();
+    get_pool();
+
+    static idle_compressor instance;
+    return instance;
+}
+#endif
+
+// decides whether tracing starts enabled: STRQUEUE_TRACE=0 turns it off,
+// any other value turns it on
+bool initial_tracing(void) {
+    const char *env = getenv("STRQUEUE_TRACE");
+
+    if (env == NULL || *env == '\0')
+        return trace_default;
+
+    return string_view(env) != "0";
+}
+
+atomic<bool> &get_tracing(void) {
+    static atomic<bool> enabled(initial_tracing());
+    return enabled;
+}
+
+// checked before every trace message, so that nothing is formatted
+// when tracing is off; constant false when it is not compiled in
+inline bool tracing(void) {
+    if constexpr (trace_compiled)
+        return get_tracing().load(memory_order_relaxed);
+    else
+        return false;
+}
+
+// traced C-string parameter, printed in quotes or as NULL
+struct quoted {
+    const char *str;
+    // length of str if it may contain NULs
+    size_t length = string_view::npos;
+};
+
+// traced array of C-string parameters, printed as {"a", "b", NULL}
+struct quoted_array {
+    const char *const *strs;
+    size_t n;
+};
+
+// traced array of IDs, printed as {1, 2, 3}
+struct id_array {
+    const unsigned long *ids;
+    size_t n;
+};
+
+// buffered destination of trace messages; they are written to stderr
+// in large blocks when the buffer fills up, on strqueue_trace_flush
+// and at program exit
+class trace_sink {
+public:
+    trace_sink(void) {
+        buffer.reserve(capacity);
+    }
+
+    ~trace_sink(void) {
+        flush();
+    }
+
+    // the sink is locked for the duration of a single message
+    unique_lock<sink_mutex> lock(void) {
+        return unique_lock<sink_mutex>(mutex);
+    }
+
+    template<typename T>
+    void append(const T &part) {
+        if constexpr (is_integral<T>::value) {
+            char digits[24];
+            const auto res = to_chars(digits, digits + sizeof(digits), part);
+            buffer.append(digits, res.ptr);
+        }
+        else if constexpr (is_same<T, quoted>::value) {
+            if (part.str == NULL) {
+                buffer.append("NULL");
+            }
+            else {
+                buffer.push_back('"');
+                if (part.length == string_view::npos)
+                    buffer.append(part.str);
+                else
+                    buffer.append(part.str, part.length);
+                buffer.push_back('"');
+            }
+        }
+        else if constexpr (is_same<T, quoted_array>::value) {
+            if (part.strs == NULL) {
+                buffer.append("NULL");
+                return;
+            }
+
+            buffer.push_back('{');
+            for (size_t i = 0; i < part.n; ++i) {
+                if (i > 0)
+                    buffer.append(", ");
+                append(quoted{part.strs[i]});
+            }
+            buffer.push_back('}');
+        }
+        else if constexpr (is_same<T, id_array>::value) {
+            if (part.ids == NULL) {
+                buffer.append("NULL");
+                return;
+            }
+
+            buffer.push_back('{');
+            for (size_t i = 0; i < part.n; ++i) {
+                if (i > 0)
+                    buffer.append(", ");
+                append(part.ids[i]);
+            }
+            buffer.push_back('}');
+        }
+        else {
+            buffer.append(part);
+        }
+    }
+
+    // called with the sink locked after a complete message
+    void end_message(void) {
+        if (buffer.size() >= capacity)
+            write_out();
+    }
+
+    void flush(void) {
+        lock_guard<sink_mutex> guard(mutex);
+        write_out();
+    }
+
+private:
+    static constexpr size_t capacity = 1 << 16;
+
+    sink_mutex mutex;
+    string buffer;
+
+    void write_out(void) {
+        fwrite(buffer.data(), 1, buffer.size(), stderr);
+        fflush(stderr);
+        buffer.clear();
+    }
+};
+
+trace_sink &get_sink(void) {
+    static trace_sink sink;
+    return sink;
+}
+
+// writes a single message put together from the given parts
+template<typename... Parts>
+void trace(const Parts &...parts) {
+    auto &sink = get_sink();
+    const auto guard = sink.lock();
+
+    (sink.append(parts), ...);
+    sink.end_message();
+}
+
+// log information about the most recently called function
+template<typename... Params>
+void debug_call(const char *name, const Params &...params) {
+    auto &sink = get_sink();
+    const auto guard = sink.lock();
+    [[maybe_unused]] const char *separator = "";
+
+    sink.append(name);
+    sink.append("(");
+    ((sink.append(separator), sink.append(params), separator = ", "), ...);
+    sink.append(")\n");
+    sink.end_message();
+}
+
+// log information about the current function's return value
+template<typename T>
+void debug_return(const char *name, T value) {
+    if constexpr (is_null_pointer<T>::value)
+        trace(name, " returns NULL\n");
+    else if constexpr (is_integral<T>::value)
+        trace(name, " returns ", value, "\n");
+    else if constexpr (is_same<T, const char*>::value)
+        trace(name, " returns ", quoted{value}, "\n");
+}
+
+// log message that a void-type function execution ended
+void debug_done(const char *name) {
+    trace(name, " done\n");
+}
+
+// log error information about non-existent queue in the map
+void debug_doesnt_exist(const char *name, unsigned long id) {
+    trace(name, ": queue ", id, " does not exist\n");
+}
+
+// log error information about invalid string position in queue
+void debug_doesnt_contain(const char *name, unsigned long id, size_t position) {
+    trace(name, ": queue ", id, " does not contain string at position ", 
+            position, "\n");
+}
+
+// log information that a function couldn't fulfill its purpose
+void debug_failed(const char *name) {
+    trace(name, " failed\n");
+}
+
+// shared part of the single string insertion functions, str is either
+// a view to be copied or a string to be moved into the queue; inserts
+// at the end if position is past the end
+template<typename Str>
+void insert_string(const char *name, unsigned long id, size_t position,
+                        Str &&str, bool valid) {
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    if (found == nullptr || !valid) {
+        count_failure(found == nullptr ? failure::missing_queue : failure::rejected);
+
+        if (tracing()) {
+            // queue does not exist
+            if (found == nullptr)
+                debug_doesnt_exist(name, id);
+
+            if (!valid)
+                debug_failed(name);
+        }
+
+        return;
+    }
+
+    auto &entry = *found;
+    unique_lock<registry_mutex> lock(entry.mutex);
+    auto &queue = entry;
+
+    // FIFO queues have no positions
+    if (queue.fifo() != nullptr) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(name);
+
+        return;
+    }
+
+    if (queue.size() < position)
+        position = queue.size();
+
+    optional<failure> failed;
+
+    if constexpr (is_same<Str, string>::value)
+        failed = queue.insert_moved(position, move(str));
+    else
+        failed = queue.insert(position, str);
+
+    if (failed) {
+        count_failure(*failed);
+
+        if (tracing())
+            debug_failed(name);
+
+        return;
+    }
+
+    if (tracing()) 
+        debug_done(name);
+}
+
+// true if strs points to n strings none of which is NULL
+bool valid_strings(const char *const *strs, size_t n) {
+    if (strs == NULL)
+        return n == 0;
+
+    for (size_t i = 0; i < n; ++i)
+        if (strs[i] == NULL)
+            return false;
+
+    return true;
+}
+
+// inserts n strings before position or at the end if position is past
+// the end; returns why they are not inserted, without counting it: the
+// queue does not exist, is a FIFO one, is over its limits, cannot store
+// the strings or !valid
+optional<failure> try_insert_views(unsigned long id, size_t position,
+                                    const string_view *strs, size_t n, bool valid) {
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    if (found == nullptr || !valid)
+        return found == nullptr ? failure::missing_queue : failure::rejected;
+
+    auto &entry = *found;
+    unique_lock<registry_mutex> lock(entry.mutex);
+    auto &queue = entry;
+
+    // FIFO queues have no positions
+    if (queue.fifo() != nullptr)
+        return failure::rejected;
+
+    if (queue.size() < position)
+        position = queue.size();
+
+    return queue.insert_range(position, strs, n);
+}
+
+// counts and traces a failure returned by try_insert_views
+void report_insert_failure(const char *name, unsigned long id, failure cause, bool valid) {
+    count_failure(cause);
+
+    if (tracing()) {
+        // queue does not exist
+        if (cause == failure::missing_queue)
+            debug_doesnt_exist(name, id);
+
+        if (cause != failure::missing_queue || !valid)
+            debug_failed(name);
+    }
+}
+
+// same as try_insert_views, returns false having counted and traced
+// the failure
+bool insert_views(const char *name, unsigned long id, size_t position,
+                    const string_view *strs, size_t n, bool valid) {
+    if (const optional<failure> failed = try_insert_views(id, position, strs, n, valid)) {
+        report_insert_failure(name, id, *failed, valid);
+        return false;
+    }
+
+    return true;
+}
+
+// shared part of the batch insertion functions, the lengths are
+// measured before any lock is taken
+void insert_strings(const char *name, unsigned long id, size_t position,
+                        const char *const *strs, size_t n) {
+    const bool valid = valid_strings(strs, n);
+    vector<string_view> views(valid ? n : 0);
+
+    for (size_t i = 0; i < views.size(); ++i)
+        views[i] = strs[i];
+
+    if (insert_views(name, id, position, views.data(), views.size(), valid) && tracing())
+        debug_done(name);
+}
+
+// adds a queue made of args to one of the shards whose index is slot
+// modulo slots, a power of 2 no greater than shard_count, and returns its ID
+template<typename... Args>
+unsigned long register_queue_in(size_t slot, size_t slots, Args &&...args) {
+    if constexpr (slot_registry) {
+        // shards are filled in turns
+        const size_t shard_index = (get_cnt()++ * slots + slot) % shard_count;
+        auto &shard = get_shards()[shard_index];
+        unique_lock<registry_mutex> shard_lock(shard.mutex);
+
+        return shard.emplace(shard_index, std::forward<Args>(args)...);
+    } else {
+        unsigned long id = get_cnt()++;
+
+        // IDs of other shards are skipped
+        while ((id & (slots - 1)) != slot)
+            id = get_cnt()++;
+
+        // check if there are valid IDs
+        assert(id < numeric_limits<unsigned long>::max());
+
+        auto &shard = get_shard(id);
+        unique_lock<registry_mutex> shard_lock(shard.mutex);
+
+        shard.emplace(id, std::forward<Args>(args)...);
+
+        return id;
+    }
+}
+
+// adds a queue made of args to the registry and returns its ID
+template<typename... Args>
+unsigned long register_queue(Args &&...args) {
+    return register_queue_in(0, 1, std::forward<Args>(args)...);
+}
+
+#ifdef STRQUEUE_NUMA
+// shards are dealt out to nodes in turns, node n taking those whose index
+// is n modulo the number returned, a power of 2 no greater than shard_count
+size_t node_slots(void) {
+    static const size_t slots = [] {
+        size_t res = 1;
+
+        while (res < node_count() && res < shard_count)
+            res *= 2;
+
+        return res;
+    }();
+
+    return slots;
+}
+#endif
+
+#ifdef STRQUEUE_HAS_MMAP
+// a snapshot is a header followed by the queues, each one described by
+// a snapshot_queue, then the lengths of its strings as uint32_t and
+// the strings themselves, every one followed by a NUL; all in native
+// byte order, FIFO and persistent queues are left out
+struct snapshot_header {
+    uint64_t magic;
+    // how IDs are laid out, see snapshot_layout
+    uint64_t layout;
+    uint64_t counter;
+    uint64_t queue_count;
+};
+
+struct snapshot_queue {
+    uint64_t id;
+    uint64_t kind;
+    uint64_t size;
+    // total length of the strings including the NULs
+    uint64_t bytes;
+};
+
+constexpr uint64_t snapshot_magic = 0x70616e7371727473u; // "strqsnap"
+
+// IDs of the slot registry depend on the number of shards,
+// so its snapshots are only restored by the same build
+constexpr uint64_t snapshot_layout(void) {
+    return slot_registry ? shard_count : 0;
+}
+
+// gathers parts of a snapshot into as few writev calls as possible,
+// merging parts that follow each other in memory
+class snapshot_writer {
+public:
+    explicit snapshot_writer(int file) : fd(file) {}
+
+    // data must stay unchanged until the next flush
+    void add(const void *data, size_t len) {
+        if (len == 0)
+            return;
+
+        if (!parts.empty()
+                && static_cast<const char*>(parts.back().iov_base) + parts.back().iov_len
+                    == data) {
+            parts.back().iov_len += len;
+            return;
+        }
+
+        if (parts.size() == max_parts)
+            flush();
+
+        parts.push_back(iovec{const_cast<void*>(data), len});
+    }
+
+    // returns false if this or any earlier write failed
+    bool flush(void) {
+        size_t first = 0;
+
+        while (ok && first < parts.size()) {
+            const size_t count = std::min(parts.size() - first, max_parts);
+            ssize_t written = writev(fd, parts.data() + first, static_cast<int>(count));
+
+            if (written <= 0) {
+                ok = (written < 0 && errno == EINTR);
+                continue;
+            }
+
+            // skips what has been written, possibly a part of a part
+            for (; written > 0; ++first) {
+                if (static_cast<size_t>(written) < parts[first].iov_len) {
+                    parts[first].iov_base = static_cast<char*>(parts[first].iov_base) + written;
+                    parts[first].iov_len -= written;
+                    break;
+                }
+
+                written -= parts[first].iov_len;
+            }
+        }
+
+        parts.clear();
+        return ok;
+    }
+
+private:
+    static constexpr size_t max_parts = IOV_MAX;
+
+    const int fd;
+    vector<iovec> parts;
+    bool ok = true;
+};
+
+// the whole contents of a file, mapped if it is a regular file
+// and read into memory otherwise
+class snapshot_contents {
+public:
+    snapshot_contents(const snapshot_contents &) = delete;
+
+    snapshot_contents &operator=(const snapshot_contents &) = delete;
+
+    explicit snapshot_contents(int fd) {
+        struct stat st;
+
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void *res = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                                MAP_PRIVATE, fd, 0);
+
+            if (res != MAP_FAILED) {
+                map = static_cast<char*>(res);
+                length = static_cast<size_t>(st.st_size);
+                madvise(map, length, MADV_SEQUENTIAL);
+                return;
+            }
+        }
+
+        char chunk[1 << 16];
+        ssize_t got;
+
+        while ((got = read(fd, chunk, sizeof(chunk))) != 0) {
+            if (got < 0 && errno != EINTR) {
+                failed = true;
+                return;
+            }
+            if (got > 0)
+                buffer.insert(buffer.end(), chunk, chunk + got);
+        }
+    }
+
+    ~snapshot_contents(void) {
+        if (map != nullptr)
+            munmap(map, length);
+    }
+
+    // nullptr if the file could not be read
+    const char *data(void) const {
+        return failed ? nullptr : (map != nullptr ? map : buffer.data());
+    }
+
+    size_t size(void) const {
+        return map != nullptr ? length : buffer.size();
+    }
+
+private:
+    char *map = nullptr;
+    size_t length = 0;
+    vector<char> buffer;
+    bool failed = false;
+};
+
+// takes values off the front of a snapshot, failing past its end
+struct snapshot_cursor {
+    const char *next, *end;
+
+    template<typename T>
+    bool take(T &value) {
+        if (static_cast<size_t>(end - next) < sizeof(T))
+            return false;
+
+        memcpy(&value, next, sizeof(T));
+        next += sizeof(T);
+        return true;
+    }
+
+    // returns the skipped bytes, nullptr if there are not enough of them
+    const char *skip(uint64_t len) {
+        if (static_cast<size_t>(end - next) < len)
+            return nullptr;
+
+        const char *res = next;
+        next += len;
+        return res;
+    }
+};
+
+// builds the queues of a snapshot, their strings copied straight into
+// storage sized up front; returns false if the snapshot is damaged
+bool parse_snapshot(const char *data, size_t size, unsigned long &counter,
+                    vector<pair<unsigned long, unique_ptr<storage>>> &queues) {
+    snapshot_cursor cursor{data, data + size};
+    snapshot_header header;
+
+    if (!cursor.take(header) || header.magic != snapshot_magic 
+            || header.layout != snapshot_layout())
+        return false;
+
+    counter = header.counter;
+    vector<string_view> strs;
+
+    for (uint64_t q = 0; q < header.queue_count; ++q) {
+        snapshot_queue queue;
+
+        if (!cursor.take(queue) || queue.kind > STRQUEUE_INTERN || queue.id == STRQUEUE_NO_ID
+                || queue.size > (size - sizeof(header)) / sizeof(uint32_t))
+            return false;
+
+        const char *lengths = cursor.skip(queue.size * sizeof(uint32_t));
+        const char *bytes = cursor.skip(queue.bytes);
+        uint64_t offset = 0;
+
+        if (lengths == nullptr || bytes == nullptr)
+            return false;
+
+        strs.resize(queue.size);
+
+        for (size_t i = 0; i < strs.size(); ++i) {
+            uint32_t len;
+
+            memcpy(&len, lengths + i * sizeof(len), sizeof(len));
+            if (queue.bytes - offset < uint64_t(len) + 1 || bytes[offset + len] != '\0')
+                return false;
+
+            strs[i] = string_view(bytes + offset, len);
+            offset += uint64_t(len) + 1;
+        }
+
+        if (offset != queue.bytes)
+            return false;
+
+        auto elements = make_storage(static_cast<unsigned int>(queue.kind));
+        elements->assign(strs.data(), strs.size());
+        queues.emplace_back(queue.id, move(elements));
+
+        // IDs handed out later must not clash with the restored ones
+        if (counter <= queue.id)
+            counter = queue.id + 1;
+    }
+
+    return cursor.next == cursor.end;
+}
+
+// the bytes of a file from its current offset on, in large blocks:
+// windows of a mapping for regular files and read calls otherwise
+class block_reader {
+public:
+    block_reader(const block_reader &) = delete;
+
+    block_reader &operator=(const block_reader &) = delete;
+
+    explicit block_reader(int file) : fd(file) {
+        struct stat st;
+
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            const off_t start = lseek(fd, 0, SEEK_CUR);
+
+            if (start >= 0 && start <= st.st_size) {
+                offset = static_cast<uint64_t>(start);
+                file_size = static_cast<uint64_t>(st.st_size);
+                mapped = true;
+            }
+        }
+    }
+
+    ~block_reader(void) {
+        unmap();
+
+        // the offset is left past the mapped bytes, as read would leave it
+        if (mapped)
+            lseek(fd, static_cast<off_t>(offset), SEEK_SET);
+    }
+
+    // the next block, which stays valid until the next call;
+    // empty at the end of the file, false if reading failed
+    bool next(string_view &block) {
+        unmap();
+
+        if (mapped) {
+            if (offset == file_size) {
+                block = string_view();
+                return true;
+            }
+
+            // mappings start at page boundaries
+            static const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+            const uint64_t first = offset - offset % page;
+            const size_t length = static_cast<size_t>(std::min(window, file_size - first));
+            void *res = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(first));
+
+            if (res != MAP_FAILED) {
+                map = static_cast<char*>(res);
+                map_length = length;
+                madvise(map, map_length, MADV_SEQUENTIAL);
+                block = string_view(map + (offset - first), length - (offset - first));
+                offset = first + length;
+                return true;
+            }
+
+            // files that cannot be mapped are read
+            mapped = false;
+            if (lseek(fd, static_cast<off_t>(offset), SEEK_SET) < 0)
+                return false;
+        }
+
+        buffer.resize(chunk);
+        for (;;) {
+            const ssize_t got = read(fd, buffer.data(), buffer.size());
+
+            if (got >= 0) {
+                block = string_view(buffer.data(), static_cast<size_t>(got));
+                return true;
+            }
+            if (errno != EINTR)
+                return false;
+        }
+    }
+
+private:
+    static constexpr uint64_t window = uint64_t(64) << 20;
+    static constexpr size_t chunk = size_t(1) << 20;
+
+    const int fd;
+    bool mapped = false;
+    uint64_t offset = 0, file_size = 0;
+    char *map = nullptr;
+    size_t map_length = 0;
+    vector<char> buffer;
+
+    void unmap(void) {
+        if (map != nullptr)
+            munmap(map, map_length);
+        map = nullptr;
+    }
+};
+
+// splits the blocks of a file into records and appends them to a queue,
+// batch_size at a time under one lock; records cut by the end of
+// a block are put together in carry
+class record_loader {
+public:
+    record_loader(const char *function, unsigned long queue, unsigned int record_format)
+        : name(function), id(queue), format(record_format) {}
+
+    // false if the strings could not be appended
+    bool feed(string_view block) {
+        const char *next = block.data(), *const end = next + block.size();
+
+        if (!carry.empty() && !complete_carry(next, end))
+            return true;
+
+        if (format == STRQUEUE_LINES) {
+            while (const char *newline = static_cast<const char*>(
+                                            memchr(next, '\n', end - next))) {
+                batch.emplace_back(next, newline - next);
+                next = newline + 1;
+
+                if (batch.size() == batch_size && !flush())
+                    return false;
+            }
+        } else {
+            uint32_t len;
+
+            while (static_cast<size_t>(end - next) >= sizeof(len)) {
+                memcpy(&len, next, sizeof(len));
+                if (static_cast<size_t>(end - next) - sizeof(len) < len)
+                    break;
+
+                batch.emplace_back(next + sizeof(len), len);
+                next += sizeof(len) + len;
+
+                if (batch.size() == batch_size && !flush())
+                    return false;
+            }
+        }
+
+        // the batch may point into the block and carry
+        if (!flush())
+            return false;
+
+        carry.assign(next, end);
+        return true;
+    }
+
+    // true if the file ends inside a length-prefixed record
+    bool truncated(void) const {
+        return format != STRQUEUE_LINES && !carry.empty();
+    }
+
+    // called at the end of the file, appends a last line without '\n';
+    // false if it could not be appended
+    bool finish(void) {
+        if (carry.empty())
+            return true;
+
+        batch.emplace_back(carry);
+        return flush();
+    }
+
+    size_t loaded(void) const {
+        return count;
+    }
+
+private:
+    static constexpr size_t batch_size = 4096;
+
+    const char *const name;
+    const unsigned long id;
+    const unsigned int format;
+    string carry;
+    vector<string_view> batch;
+    size_t count = 0;
+
+    // moves bytes from the front of the block to carry until it holds
+    // a whole record, which is added to the batch; false if the block
+    // ends first
+    bool complete_carry(const char *&next, const char *end) {
+        if (format == STRQUEUE_LINES) {
+            const char *newline = static_cast<const char*>(memchr(next, '\n', end - next));
+
+            carry.append(next, (newline == nullptr ? end : newline) - next);
+            if (newline == nullptr)
+                return false;
+
+            next = newline + 1;
+            batch.emplace_back(carry);
+            return true;
+        }
+
+        uint32_t len = 0;
+
+        for (;;) {
+            if (carry.size() >= sizeof(len))
+                memcpy(&len, carry.data(), sizeof(len));
+
+            const size_t needed = carry.size() < sizeof(len) ? sizeof(len) - carry.size()
+                                    : sizeof(len) + len - carry.size();
+
+            if (carry.size() >= sizeof(len) && needed == 0) {
+                batch.emplace_back(string_view(carry).substr(sizeof(len)));
+                return true;
+            }
+
+            if (next == end)
+                return false;
+
+            const size_t taken = std::min(needed, static_cast<size_t>(end - next));
+
+            carry.append(next, taken);
+            next += taken;
+        }
+    }
+
+    bool flush(void) {
+        if (batch.empty())
+            return true;
+
+        const size_t end = numeric_limits<size_t>::max();
+        optional<failure> failed = try_insert_views(id, end, batch.data(), batch.size(), true);
+
+        // a batch is appended whole or not at all, so one that does not fit
+        // is appended record by record, up to the first one that does not
+        if (failed && *failed != failure::missing_queue) {
+            failed.reset();
+            for (size_t i = 0; i < batch.size() && !failed; ++i)
+                if (!(failed = try_insert_views(id, end, &batch[i], 1, true)))
+                    ++count;
+        }
+        else if (!failed) {
+            count += batch.size();
+        }
+
+        batch.clear();
+
+        if (failed) {
+            report_insert_failure(name, id, *failed, true);
+            return false;
+        }
+
+        return true;
+    }
+};
+
+// writes records through snapshot_writer, copying short strings and
+// the delimiters into a buffer, which lets consecutive ones go out as
+// one part, and pointing at longer strings where they are
+class record_writer {
+public:
+    explicit record_writer(int fd) : writer(fd), buffer(new char[buffer_size]) {}
+
+    // str must stay unchanged until the next flush or flush_pointed
+    void add(string_view str) {
+        if (str.size() < copy_limit) {
+            stage(str.data(), str.size());
+        } else {
+            writer.add(str.data(), str.size());
+            pointed = true;
+        }
+    }
+
+    // len must not exceed copy_limit
+    void stage(const void *data, size_t len) {
+        if (buffer_size - used < len)
+            flush();
+
+        memcpy(buffer.get() + used, data, len);
+        writer.add(buffer.get() + used, len);
+        used += len;
+    }
+
+    // returns false if this or any earlier write failed
+    bool flush(void) {
+        used = 0;
+        pointed = false;
+        return writer.flush();
+    }
+
+    // flushes only if a part points at a string passed to add, after which
+    // everything added may change; copied parts stay buffered
+    void flush_pointed(void) {
+        if (pointed)
+            flush();
+    }
+
+private:
+    static constexpr size_t buffer_size = size_t(1) << 18;
+    static constexpr size_t copy_limit = 512;
+
+    snapshot_writer writer;
+    unique_ptr<char[]> buffer;
+    size_t used = 0;
+    // whether a part points outside the buffer
+    bool pointed = false;
+};
+#endif
+} // namespace
+
+namespace cxx {
+
+struct strqueue_fifo {
+    // for tracing only, the queue may have been deleted
+    const unsigned long id;
+    const shared_ptr<fifo_ring> ring;
+};
+
+namespace {
+
+// the popped string in buf or malloc'ed, see fifo_item::take; a string
+// that cannot be allocated is lost, which is counted as a failure
+char *pop_copy(const char *name, fifo_item &item, char *buf, size_t size) {
+    char *res = item.take(buf, size);
+
+    if (res == NULL) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(name);
+    }
+
+    return res;
+}
+
+} // namespace
+
+unsigned long strqueue_new(void) {
+    const call_scope scope(STRQUEUE_FN_NEW);
+
+    if (tracing())
+        debug_call(__func__);
+
+    unsigned long id = register_queue(STRQUEUE_DEQUE);
+
+    if (tracing())
+        debug_return(__func__, id);
+
+    return id;
+}
+
+unsigned long strqueue_new_ex(unsigned int flags) {
+    const call_scope scope(STRQUEUE_FN_NEW_EX);
+
+    if (tracing())
+        debug_call(__func__, flags);
+
+    unsigned long id = register_queue(flags);
+
+    if (tracing())
+        debug_return(__func__, id);
+
+    return id;
+}
+
+unsigned long strqueue_new_with_capacity(unsigned int flags, size_t count, size_t bytes) {
+    const call_scope scope(STRQUEUE_FN_NEW_WITH_CAPACITY);
+
+    if (tracing())
+        debug_call(__func__, flags, count, bytes);
+
+    unsigned long id = register_queue(flags, count, bytes);
+
+    if (tracing())
+        debug_return(__func__, id);
+
+    return id;
+}
+
+unsigned long strqueue_new_on(unsigned int flags, int node) {
+    const call_scope scope(STRQUEUE_FN_NEW_ON);
+
+    if (tracing())
+        debug_call(__func__, flags, node);
+
+#ifdef STRQUEUE_NUMA
+    if (node == STRQUEUE_LOCAL_NODE)
+        node = current_node();
+
+    // there is no such node
+    if (node < 0 || static_cast<size_t>(node) >= node_count()) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(__func__);
+
+        return STRQUEUE_NO_ID;
+    }
+
+    const size_t slots = node_slots(), slot = static_cast<size_t>(node) & (slots - 1);
+
+    // strings of other kinds are wherever the inserting thread allocates them
+    unsigned long id = (flags & STRQUEUE_KIND_MASK) == STRQUEUE_ARENA
+        ? register_queue_in(slot, slots, make_storage(STRQUEUE_ARENA | node_flags(node)))
+        : register_queue_in(slot, slots, flags);
+#else
+    unsigned long id = register_queue(flags);
+#endif
+
+    if (tracing())
+        debug_return(__func__, id);
+
+    return id;
+}
+
+void strqueue_delete(unsigned long id) {
+    const call_scope scope(STRQUEUE_FN_DELETE);
+
+    if (tracing()) 
+        debug_call(__func__, id);
+
+    auto &shard = get_shard(id);
+    unique_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    // queue does not exist
+    if (found == nullptr) {
+        count_failure(failure::missing_queue);
+
+        if (tracing())
+            debug_doesnt_exist(__func__, id);
+        
+        return;
+    }
+
+    found->retire();
+    release_bytes(found->byte_size());
+    shard.erase(id);
+
+    if (tracing())
+        debug_done(__func__);
+}
+
+size_t strqueue_size(unsigned long id) {
+    const call_scope scope(STRQUEUE_FN_SIZE);
+
+    if (tracing())
+        debug_call(__func__, id);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    // queue does not exist
+    if (found == nullptr) {
+        count_failure(failure::missing_queue);
+
+        if (tracing()) {
+            debug_doesnt_exist(__func__, id);
+            debug_return(__func__, 0);
+        }
+
+        return 0;
+    }
+
+    const auto &entry = *found;
+    shared_lock<registry_mutex> lock(entry.mutex);
+    const auto &queue = entry;
+
+    queue.count_read();
+
+    if (tracing())
+        debug_return(__func__, queue.size());
+
+    return queue.size();
+}
+
+void strqueue_insert_at(unsigned long id, size_t position, const char *str) {
+    const call_scope scope(STRQUEUE_FN_INSERT_AT);
+
+    if (tracing())
+        debug_call(__func__, id, position, quoted{str});
+
+    insert_string(__func__, id, position, 
+                    str == NULL ? string_view() : string_view(str), str != NULL);
+}
+
+void strqueue_insert_at_n(unsigned long id, size_t position, const char *str,
+                            size_t len) {
+    const call_scope scope(STRQUEUE_FN_INSERT_AT_N);
+
+    if (tracing())
+        debug_call(__func__, id, position, quoted{str, len}, len);
+
+    insert_string(__func__, id, position, string_view(str, str == NULL ? 0 : len),
+                    str != NULL);
+}
+
+void strqueue_insert_at(unsigned long id, size_t position, string_view str) {
+    const call_scope scope(STRQUEUE_FN_INSERT_AT);
+
+    if (tracing())
+        debug_call(__func__, id, position, quoted{str.data(), str.size()});
+
+    insert_string(__func__, id, position, str, true);
+}
+
+void strqueue_insert_at(unsigned long id, size_t position, string &&str) {
+    const call_scope scope(STRQUEUE_FN_INSERT_AT);
+
+    if (tracing())
+        debug_call(__func__, id, position, quoted{str.data(), str.size()});
+
+    insert_string(__func__, id, position, move(str), true);
+}
+
+void strqueue_remove_at(unsigned long id, size_t position) {
+    const call_scope scope(STRQUEUE_FN_REMOVE_AT);
+
+    if (tracing())
+        debug_call(__func__, id, position);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    // queue does not exist
+    if (found == nullptr) {
+        count_failure(failure::missing_queue);
+
+        if (tracing())
+            debug_doesnt_exist(__func__, id);
+
+        return;
+    }
+
+    auto &entry = *found;
+    unique_lock<registry_mutex> lock(entry.mutex);
+    auto &queue = entry;
+
+    // FIFO queues have no positions
+    if (queue.fifo() != nullptr) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(__func__);
+
+        return;
+    }
+
+    // invalid element position
+    if (queue.size() <= position) {
+        count_failure(failure::bad_position);
+
+        if (tracing())
+            debug_doesnt_contain(__func__, id, position);
+
+        return;
+    }
+
+    if (!queue.erase(position)) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(__func__);
+
+        return;
+    }
+
+    if (tracing())
+        debug_done(__func__);
+}
+
+const char* strqueue_get_at(unsigned long id, size_t position) {
+    const call_scope scope(STRQUEUE_FN_GET_AT);
+
+    if (tracing())
+        debug_call(__func__, id, position);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+    const auto &entry = (found == nullptr) 
+                            ? get_empty_queue() : *found;
+    shared_lock<registry_mutex> lock(entry.mutex);
+    const auto &queue = entry;
+    const char *res;
+
+    if (found == nullptr || queue.fifo() != nullptr || queue.size() <= position) {
+        count_failure(found == nullptr ? failure::missing_queue
+                        : (queue.fifo() != nullptr ? failure::rejected : failure::bad_position));
+
+        if (tracing()) {
+            // queue does not exist
+            if (found == nullptr)
+                debug_doesnt_exist(__func__, id);
+            // FIFO queues have no positions
+            else if (queue.fifo() != nullptr)
+                debug_failed(__func__);
+            // invalid element position
+            else
+                debug_doesnt_contain(__func__, id, position);
+
+            debug_return(__func__, nullptr);
+        }
+
+        return NULL;
+    }
+
+    queue.count_read();
+    res = queue.at(position).data();
+    if (tracing())
+        debug_return(__func__, res);
+
+    return res;
+}
+
+int strqueue_view_at(unsigned long id, size_t position, struct strqueue_view *view) {
+    const call_scope scope(STRQUEUE_FN_VIEW_AT);
+
+    if (tracing())
+        debug_call(__func__, id, position);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+    const auto &entry = (found == nullptr) 
+                            ? get_empty_queue() : *found;
+    shared_lock<registry_mutex> lock(entry.mutex);
+    const auto &queue = entry;
+
+    if (found == nullptr || queue.fifo() != nullptr || queue.size() <= position
+            || view == NULL) {
+        count_failure(found == nullptr ? failure::missing_queue
+                        : (queue.fifo() == nullptr && queue.size() <= position
+                            ? failure::bad_position : failure::rejected));
+
+        if (tracing()) {
+            // queue does not exist
+            if (found == nullptr)
+                debug_doesnt_exist(__func__, id);
+            // invalid element position
+            else if (queue.fifo() == nullptr && queue.size() <= position)
+                debug_doesnt_contain(__func__, id, position);
+            else
+                debug_failed(__func__);
+
+            debug_return(__func__, 0);
+        }
+
+        return 0;
+    }
+
+    const string_view str = queue.at(position);
+
+    queue.count_read();
+    view->data = str.data();
+    view->len = str.size();
+    view->id = id;
+    view->epoch = queue.epoch();
+
+    if (tracing())
+        debug_return(__func__, 1);
+
+    return 1;
+}
+
+int strqueue_view_valid(const struct strqueue_view *view) {
+    const call_scope scope(STRQUEUE_FN_VIEW_VALID);
+
+    if (tracing()) {
+        if (view == NULL)
+            debug_call(__func__, quoted{NULL});
+        else
+            debug_call(__func__, view->id, view->epoch);
+    }
+
+    if (view == NULL) {
+        if (tracing())
+            debug_return(__func__, 0);
+
+        return 0;
+    }
+
+    auto &shard = get_shard(view->id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(view->id);
+    int res = 0;
+
+    if (found == nullptr) {
+        count_failure(failure::missing_queue);
+
+        if (tracing())
+            debug_doesnt_exist(__func__, view->id);
+    }
+    else {
+        shared_lock<registry_mutex> lock(found->mutex);
+        res = (found->epoch() == view->epoch) ? 1 : 0;
+    }
+
+    if (tracing())
+        debug_return(__func__, res);
+
+    return res;
+}
+
+void strqueue_clear(unsigned long id) {
+    const call_scope scope(STRQUEUE_FN_CLEAR);
+
+    if (tracing())
+        debug_call(__func__, id);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    // queue does not exist
+    if (found == nullptr) {
+        count_failure(failure::missing_queue);
+
+        if (tracing())
+            debug_doesnt_exist(__func__, id);
+        return;
+    }
+
+    auto &entry = *found;
+    unique_lock<registry_mutex> lock(entry.mutex);
+    auto &queue = entry;
+
+    if (!queue.clear()) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(__func__);
+
+        return;
+    }
+
+    if (tracing())
+        debug_done(__func__);
+}
+
+int strqueue_comp(unsigned long id1, unsigned long id2) {
+    const call_scope scope(STRQUEUE_FN_COMP);
+
+    if (tracing())
+        debug_call(__func__, id1, id2);
+
+    auto &shard1 = get_shard(id1), &shard2 = get_shard(id2);
+    const auto shard_locks = lock_both_shared(shard1.mutex, shard2.mutex);
+    auto *found1 = shard1.find(id1), *found2 = shard2.find(id2);
+
+    // check if any of the queues does not exist
+    const bool not_in_1 = (found1 == nullptr), 
+               not_in_2 = (found2 == nullptr);
+    // if a queue does not exist, it is treated as an empty queue
+    const auto &e1 = not_in_1 ? get_empty_queue() : *found1;
+    const auto &e2 = not_in_2 ? get_empty_queue() : *found2;
+    const auto queue_locks = lock_both_shared(e1.mutex, e2.mutex);
+    const auto &q1 = e1.contents(), &q2 = e2.contents();
+    int res = 2;
+
+    // the missing queues are compared as empty ones nevertheless
+    if (not_in_1 || not_in_2)
+        count_failure(failure::missing_queue);
+
+    if (tracing()) {
+        if(not_in_1)
+            debug_doesnt_exist(__func__, id1);
+
+        if(not_in_2)
+            debug_doesnt_exist(__func__, id2);       
+    }
+    
+    if (!not_in_1)
+        e1.count_read();
+    if (!not_in_2)
+        e2.count_read();
+
+    res = (&e1 == &e2) ? 0 : storage_compare(q1, q2);
+
+    if (tracing())
+        debug_return(__func__, res);   
+
+    return res;
+}
+
+int strqueue_equal(unsigned long id1, unsigned long id2) {
+    const call_scope scope(STRQUEUE_FN_EQUAL);
+
+    if (tracing())
+        debug_call(__func__, id1, id2);
+
+    auto &shard1 = get_shard(id1), &shard2 = get_shard(id2);
+    const auto shard_locks = lock_both_shared(shard1.mutex, shard2.mutex);
+    auto *found1 = shard1.find(id1), *found2 = shard2.find(id2);
+
+    // check if any of the queues does not exist
+    const bool not_in_1 = (found1 == nullptr), 
+               not_in_2 = (found2 == nullptr);
+    // if a queue does not exist, it is treated as an empty queue
+    const auto &q1 = not_in_1 ? get_empty_queue() : *found1;
+    const auto &q2 = not_in_2 ? get_empty_queue() : *found2;
+    const auto queue_locks = lock_both_shared(q1.mutex, q2.mutex);
+
+    if (not_in_1 || not_in_2)
+        count_failure(failure::missing_queue);
+
+    if (tracing()) {
+        if (not_in_1)
+            debug_doesnt_exist(__func__, id1);
+
+        if (not_in_2)
+            debug_doesnt_exist(__func__, id2);
+    }
+
+    if (!not_in_1)
+        q1.count_read();
+    if (!not_in_2)
+        q2.count_read();
+
+    const int res = queues_equal(q1, q2) ? 1 : 0;
+
+    if (tracing())
+        debug_return(__func__, res);
+
+    return res;
+}
+
+void strqueue_push_back_n(unsigned long id, const char **strs, size_t n) {
+    const call_scope scope(STRQUEUE_FN_PUSH_BACK_N);
+
+    if (tracing())
+        debug_call(__func__, id, quoted_array{strs, n}, n);
+
+    insert_strings(__func__, id, numeric_limits<size_t>::max(), strs, n);
+}
+
+void strqueue_insert_range_at(unsigned long id, size_t position,
+                                const char **strs, size_t n) {
+    const call_scope scope(STRQUEUE_FN_INSERT_RANGE_AT);
+
+    if (tracing())
+        debug_call(__func__, id, position, quoted_array{strs, n}, n);
+
+    insert_strings(__func__, id, position, strs, n);
+}
+
+void strqueue_remove_range(unsigned long id, size_t position, size_t count) {
+    const call_scope scope(STRQUEUE_FN_REMOVE_RANGE);
+
+    if (tracing())
+        debug_call(__func__, id, position, count);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    // queue does not exist
+    if (found == nullptr) {
+        count_failure(failure::missing_queue);
+
+        if (tracing())
+            debug_doesnt_exist(__func__, id);
+
+        return;
+    }
+
+    auto &entry = *found;
+    unique_lock<registry_mutex> lock(entry.mutex);
+    auto &queue = entry;
+
+    // FIFO queues have no positions
+    if (queue.fifo() != nullptr) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(__func__);
+
+        return;
+    }
+
+    // invalid element position
+    if (queue.size() <= position) {
+        count_failure(failure::bad_position);
+
+        if (tracing())
+            debug_doesnt_contain(__func__, id, position);
+
+        return;
+    }
+
+    // the range is cut short at the end of the queue
+    if (queue.size() - position < count)
+        count = queue.size() - position;
+
+    if (!queue.erase_range(position, count)) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(__func__);
+
+        return;
+    }
+
+    if (tracing())
+        debug_done(__func__);
+}
+
+size_t strqueue_get_range(unsigned long id, size_t position, size_t count,
+                            const char **out) {
+    const call_scope scope(STRQUEUE_FN_GET_RANGE);
+
+    if (tracing())
+        debug_call(__func__, id, position, count);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+    const auto &entry = (found == nullptr) 
+                            ? get_empty_queue() : *found;
+    shared_lock<registry_mutex> lock(entry.mutex);
+    const auto &queue = entry;
+
+    if (found == nullptr || queue.fifo() != nullptr || queue.size() <= position
+            || out == NULL) {
+        count_failure(found == nullptr ? failure::missing_queue
+                        : (queue.fifo() == nullptr && queue.size() <= position
+                            ? failure::bad_position : failure::rejected));
+
+        if (tracing()) {
+            // queue does not exist
+            if (found == nullptr)
+                debug_doesnt_exist(__func__, id);
+            // invalid element position
+            else if (queue.fifo() == nullptr && queue.size() <= position)
+                debug_doesnt_contain(__func__, id, position);
+            else
+                debug_failed(__func__);
+
+            debug_return(__func__, 0);
+        }
+
+        return 0;
+    }
+
+    // the range is cut short at the end of the queue
+    if (queue.size() - position < count)
+        count = queue.size() - position;
+
+    queue.count_read();
+    queue.get_range(position, count, out);
+
+    if (tracing())
+        debug_return(__func__, count);
+
+    return count;
+}
+
+size_t strqueue_view_range(unsigned long id, size_t position, size_t count,
+                            struct strqueue_view *out) {
+    const call_scope scope(STRQUEUE_FN_VIEW_RANGE);
+
+    if (tracing())
+        debug_call(__func__, id, position, count);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+    const auto &entry = (found == nullptr) 
+                            ? get_empty_queue() : *found;
+    shared_lock<registry_mutex> lock(entry.mutex);
+    const auto &queue = entry;
+
+    if (found == nullptr || queue.fifo() != nullptr || queue.size() <= position
+            || out == NULL) {
+        count_failure(found == nullptr ? failure::missing_queue
+                        : (queue.fifo() == nullptr && queue.size() <= position
+                            ? failure::bad_position : failure::rejected));
+
+        if (tracing()) {
+            // queue does not exist
+            if (found == nullptr)
+                debug_doesnt_exist(__func__, id);
+            // invalid element position
+            else if (queue.fifo() == nullptr && queue.size() <= position)
+                debug_doesnt_contain(__func__, id, position);
+            else
+                debug_failed(__func__);
+
+            debug_return(__func__, 0);
+        }
+
+        return 0;
+    }
+
+    // the range is cut short at the end of the queue
+    if (queue.size() - position < count)
+        count = queue.size() - position;
+
+    constexpr size_t batch = 64;
+    string_view strs[batch];
+
+    queue.count_read();
+    for (size_t done = 0; done < count; done += batch) {
+        const size_t n = std::min(batch, count - done);
+
+        queue.get_views(position + done, n, strs);
+        for (size_t i = 0; i < n; ++i)
+            out[done + i] = strqueue_view{strs[i].data(), strs[i].size(), id, queue.epoch()};
+    }
+
+    if (tracing())
+        debug_return(__func__, count);
+
+    return count;
+}
+
+unsigned long strqueue_new_fifo(unsigned int flags, size_t capacity) {
+    const call_scope scope(STRQUEUE_FN_NEW_FIFO);
+
+    if (tracing())
+        debug_call(__func__, flags, capacity);
+
+    unique_ptr<fifo_ring> ring;
+
+    if ((flags & STRQUEUE_FIFO_MPMC) != 0)
+        ring = make_unique<mpmc_ring>(capacity);
+    else
+        ring = make_unique<spsc_ring>(capacity);
+
+    unsigned long id = register_queue(make_unique<deque_storage>(), move(ring));
+
+    if (tracing())
+        debug_return(__func__, id);
+
+    return id;
+}
+
+unsigned long strqueue_open(const char *path) {
+    const call_scope scope(STRQUEUE_FN_OPEN);
+
+    if (tracing())
+        debug_call(__func__, quoted{path});
+
+    unsigned long id = STRQUEUE_NO_ID;
+
+#ifdef STRQUEUE_HAS_MMAP
+    if (path != NULL)
+        if (auto elements = persistent_storage::open(path))
+            id = register_queue(move(elements));
+#endif
+
+    if (id == STRQUEUE_NO_ID) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(__func__);
+        return id;
+    }
+
+    if (tracing())
+        debug_return(__func__, id);
+
+    return id;
+}
+
+int strqueue_snapshot(int fd) {
+    const call_scope scope(STRQUEUE_FN_SNAPSHOT);
+
+    if (tracing())
+        debug_call(__func__, fd);
+
+    int res = 0;
+
+#ifdef STRQUEUE_HAS_MMAP
+    // queues are neither created nor deleted while they are written out
+    auto &shards = get_shards();
+    vector<shared_lock<registry_mutex>> shard_locks;
+    snapshot_header header{snapshot_magic, snapshot_layout(), get_cnt(), 0};
+
+    for (auto &shard : shards)
+        shard_locks.emplace_back(shard.mutex);
+
+    // called with the queue locked, its elements may be recompressed
+    auto saved = [](const queue_entry &queue) {
+        return queue.fifo() == nullptr && queue.contents().kind().has_value();
+    };
+
+    for (size_t i = 0; i < shard_count; ++i)
+        shards[i].for_each(i, [&](unsigned long, queue_entry &queue) {
+            shared_lock<registry_mutex> queue_lock(queue.mutex);
+            header.queue_count += saved(queue);
+        });
+
+    // small queues are copied into the buffer of the writer and go out
+    // together, those pointed at are written before they are unlocked
+    record_writer writer(fd);
+    vector<uint32_t> lengths;
+    static const char nul = '\0';
+
+    writer.stage(&header, sizeof(header));
+
+    for (size_t i = 0; i < shard_count; ++i)
+        shards[i].for_each(i, [&](unsigned long id, queue_entry &queue) {
+            shared_lock<registry_mutex> queue_lock(queue.mutex);
+
+            if (!saved(queue))
+                return;
+
+            // restored queues are not placed on any node
+            const unsigned int kind = *queue.contents().kind() & STRQUEUE_KIND_MASK;
+            const bool terminated = !queue.compressed();
+
+            queue.visit_elements([&](const string_view *strs, size_t n) {
+                snapshot_queue description{id, kind, n, 0};
+
+                lengths.resize(n);
+                for (size_t j = 0; j < n; ++j) {
+                    lengths[j] = static_cast<uint32_t>(strs[j].size());
+                    description.bytes += strs[j].size() + 1;
+                }
+
+                writer.stage(&description, sizeof(description));
+                writer.add(string_view(reinterpret_cast<const char*>(lengths.data()),
+                                        lengths.size() * sizeof(uint32_t)));
+                // the NULs are written together with the strings
+                // unless they are read from a compressed block
+                for (size_t j = 0; j < n; ++j) {
+                    writer.add(string_view(strs[j].data(), strs[j].size() + terminated));
+                    if (!terminated)
+                        writer.stage(&nul, 1);
+                }
+
+                // the strings may change once the queue is unlocked,
+                // those read from a block are gone once visit returns,
+                // and lengths is reused by the next queue
+                writer.flush_pointed();
+            });
+        });
+
+    res = writer.flush();
+#endif
+
+    if (res == 0)
+        count_failure(failure::rejected);
+
+    if (tracing()) {
+        if (res == 0)
+            debug_failed(__func__);
+
+        debug_return(__func__, res);
+    }
+
+    return res;
+}
+
+int strqueue_restore(int fd) {
+    const call_scope scope(STRQUEUE_FN_RESTORE);
+
+    if (tracing())
+        debug_call(__func__, fd);
+
+    int res = 0;
+
+#ifdef STRQUEUE_HAS_MMAP
+    const snapshot_contents contents(fd);
+    vector<pair<unsigned long, unique_ptr<storage>>> queues;
+    unsigned long counter;
+
+    if (contents.data() != nullptr
+            && parse_snapshot(contents.data(), contents.size(), counter, queues)) {
+        array<vector<pair<unsigned long, unique_ptr<storage>>>, shard_count> shard_queues;
+
+        for (auto &queue : queues)
+            shard_queues[queue.first % shard_count].push_back(move(queue));
+
+        auto &shards = get_shards();
+        vector<unique_lock<registry_mutex>> shard_locks;
+
+        for (auto &shard : shards)
+            shard_locks.emplace_back(shard.mutex);
+
+        for (size_t i = 0; i < shard_count; ++i) {
+            shards[i].for_each(i, [](unsigned long, queue_entry &queue) {
+                release_bytes(queue.byte_size());
+            });
+            shards[i].restore(shard_queues[i]);
+        }
+
+        if (get_cnt() < counter)
+            get_cnt() = counter;
+
+        res = 1;
+    }
+#endif
+
+    if (res == 0)
+        count_failure(failure::rejected);
+
+    if (tracing()) {
+        if (res == 0)
+            debug_failed(__func__);
+
+        debug_return(__func__, res);
+    }
+
+    return res;
+}
+
+size_t strqueue_load_fd(unsigned long id, int fd, unsigned int format) {
+    const call_scope scope(STRQUEUE_FN_LOAD_FD);
+
+    if (tracing())
+        debug_call(__func__, id, fd, format);
+
+    size_t res = 0;
+    bool exists, fifo;
+
+    // checked before anything is read, and again for every batch
+    {
+        auto &shard = get_shard(id);
+        shared_lock<registry_mutex> shard_lock(shard.mutex);
+        auto *found = shard.find(id);
+
+        exists = (found != nullptr);
+        fifo = exists && found->fifo() != nullptr;
+    }
+
+#ifdef STRQUEUE_HAS_MMAP
+    if (exists && !fifo && (format == STRQUEUE_LINES || format == STRQUEUE_LENGTH_PREFIXED)) {
+        block_reader reader(fd);
+        record_loader loader(__func__, id, format);
+        string_view block;
+        bool read_ok = true, appended = true;
+
+        // the queue is looked up again for every batch, so it is only
+        // locked while strings are appended to it; failures to append
+        // are counted by the loader
+        while (appended && (read_ok = reader.next(block)) && !block.empty())
+            appended = loader.feed(block);
+
+        // a file may not end inside a length-prefixed record
+        if (appended && read_ok && !loader.truncated())
+            loader.finish();
+        res = loader.loaded();
+
+        if (appended && (!read_ok || loader.truncated())) {
+            count_failure(failure::rejected);
+
+            if (tracing())
+                debug_failed(__func__);
+        }
+
+        if (tracing())
+            debug_return(__func__, res);
+
+        return res;
+    }
+#endif
+
+    count_failure(exists ? failure::rejected : failure::missing_queue);
+
+    if (tracing()) {
+        // queue does not exist
+        if (!exists)
+            debug_doesnt_exist(__func__, id);
+        else
+            debug_failed(__func__);
+
+        debug_return(__func__, res);
+    }
+
+    return res;
+}
+
+int strqueue_dump_fd(unsigned long id, int fd, unsigned int format) {
+    const call_scope scope(STRQUEUE_FN_DUMP_FD);
+
+    if (tracing())
+        debug_call(__func__, id, fd, format);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+    const auto &entry = (found == nullptr) 
+                            ? get_empty_queue() : *found;
+    shared_lock<registry_mutex> lock(entry.mutex);
+    const auto &queue = entry;
+    int res = 0;
+
+#ifdef STRQUEUE_HAS_MMAP
+    if (found != nullptr && queue.fifo() == nullptr
+            && (format == STRQUEUE_LINES || format == STRQUEUE_LENGTH_PREFIXED)) {
+        constexpr size_t batch = 64;
+        const char newline = '\n';
+        string_view strs[batch];
+        record_writer writer(fd);
+        bool fits = true;
+
+        queue.count_read();
+        for (size_t done = 0; fits && done < queue.size(); done += batch) {
+            const size_t n = std::min(batch, queue.size() - done);
+
+            queue.get_views(done, n, strs);
+            for (size_t i = 0; i < n; ++i) {
+                if (format == STRQUEUE_LINES) {
+                    writer.add(strs[i]);
+                    writer.stage(&newline, 1);
+                    continue;
+                }
+
+                // lengths are written as uint32_t
+                if (strs[i].size() > numeric_limits<uint32_t>::max()) {
+                    fits = false;
+                    break;
+                }
+
+                const uint32_t len = static_cast<uint32_t>(strs[i].size());
+
+                writer.stage(&len, sizeof(len));
+                writer.add(strs[i]);
+            }
+        }
+
+        res = writer.flush() && fits;
+    }
+#endif
+
+    if (res == 0) {
+        count_failure(found == nullptr ? failure::missing_queue : failure::rejected);
+
+        if (tracing()) {
+            // queue does not exist
+            if (found == nullptr)
+                debug_doesnt_exist(__func__, id);
+            else
+                debug_failed(__func__);
+        }
+    }
+
+    if (tracing())
+        debug_return(__func__, res);
+
+    return res;
+}
+
+int strqueue_push(unsigned long id, const char *str) {
+    const call_scope scope(STRQUEUE_FN_PUSH);
+
+    if (tracing())
+        debug_call(__func__, id, quoted{str});
+
+    // the shard is only locked in shared mode to keep the queue from
+    // being deleted, the ring itself is lock-free
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+    fifo_ring *ring = (found == nullptr) ? nullptr : found->fifo();
+
+    if (ring == nullptr || str == NULL) {
+        count_failure(found == nullptr ? failure::missing_queue : failure::rejected);
+
+        if (tracing()) {
+            // queue does not exist
+            if (found == nullptr)
+                debug_doesnt_exist(__func__, id);
+            else
+                debug_failed(__func__);
+
+            debug_return(__func__, 0);
+        }
+
+        return 0;
+    }
+
+    // the ring is full
+    if (!ring->push(str)) {
+        count_failure(failure::rejected);
+
+        if (tracing()) {
+            debug_failed(__func__);
+            debug_return(__func__, 0);
+        }
+
+        return 0;
+    }
+
+    if (tracing())
+        debug_return(__func__, 1);
+
+    return 1;
+}
+
+char *strqueue_pop(unsigned long id) {
+    const call_scope scope(STRQUEUE_FN_POP);
+
+    if (tracing())
+        debug_call(__func__, id);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+    fifo_ring *ring = (found == nullptr) ? nullptr : found->fifo();
+
+    if (ring == nullptr) {
+        count_failure(found == nullptr ? failure::missing_queue : failure::rejected);
+
+        if (tracing()) {
+            // queue does not exist
+            if (found == nullptr)
+                debug_doesnt_exist(__func__, id);
+            else
+                debug_failed(__func__);
+
+            debug_return(__func__, nullptr);
+        }
+
+        return NULL;
+    }
+
+    fifo_item item;
+    char *res = ring->pop(item) ? pop_copy(__func__, item, NULL, 0) : NULL;
+
+    if (tracing()) {
+        if (res == NULL)
+            debug_return(__func__, nullptr);
+        else
+            debug_return(__func__, static_cast<const char*>(res));
+    }
+
+    return res;
+}
+
+struct strqueue_fifo *strqueue_fifo_acquire(unsigned long id) {
+    const call_scope scope(STRQUEUE_FN_FIFO_ACQUIRE);
+
+    if (tracing())
+        debug_call(__func__, id);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    if (found == nullptr || found->fifo() == nullptr) {
+        count_failure(found == nullptr ? failure::missing_queue : failure::rejected);
+
+        if (tracing()) {
+            // queue does not exist
+            if (found == nullptr)
+                debug_doesnt_exist(__func__, id);
+            else
+                debug_failed(__func__);
+
+            debug_return(__func__, nullptr);
+        }
+
+        return NULL;
+    }
+
+    auto *res = new strqueue_fifo{id, found->share_fifo()};
+
+    if (tracing())
+        debug_done(__func__);
+
+    return res;
+}
+
+void strqueue_fifo_release(struct strqueue_fifo *fifo) {
+    const call_scope scope(STRQUEUE_FN_FIFO_RELEASE);
+
+    if (tracing())
+        debug_call(__func__, fifo == NULL ? STRQUEUE_NO_ID : fifo->id);
+
+    delete fifo;
+
+    if (tracing())
+        debug_done(__func__);
+}
+
+int strqueue_fifo_push(struct strqueue_fifo *fifo, const char *str) {
+    const call_scope scope(STRQUEUE_FN_FIFO_PUSH);
+
+    if (tracing())
+        debug_call(__func__, fifo == NULL ? STRQUEUE_NO_ID : fifo->id, quoted{str});
+
+    // the ring is full
+    if (fifo == NULL || str == NULL || !fifo->ring->push(str)) {
+        count_failure(failure::rejected);
+
+        if (tracing()) {
+            debug_failed(__func__);
+            debug_return(__func__, 0);
+        }
+
+        return 0;
+    }
+
+    if (tracing())
+        debug_return(__func__, 1);
+
+    return 1;
+}
+
+char *strqueue_fifo_pop(struct strqueue_fifo *fifo, char *buf, size_t size) {
+    const call_scope scope(STRQUEUE_FN_FIFO_POP);
+
+    if (tracing())
+        debug_call(__func__, fifo == NULL ? STRQUEUE_NO_ID : fifo->id, size);
+
+    if (fifo == NULL) {
+        count_failure(failure::rejected);
+
+        if (tracing()) {
+            debug_failed(__func__);
+            debug_return(__func__, nullptr);
+        }
+
+        return NULL;
+    }
+
+    fifo_item item;
+    char *res = fifo->ring->pop(item) ? pop_copy(__func__, item, buf, size) : NULL;
+
+    if (tracing()) {
+        if (res == NULL)
+            debug_return(__func__, nullptr);
+        else
+            debug_return(__func__, static_cast<const char*>(res));
+    }
+
+    return res;
+}
+
+unsigned long strqueue_clone(unsigned long id) {
+    const call_scope scope(STRQUEUE_FN_CLONE);
+
+    if (tracing())
+        debug_call(__func__, id);
+
+    unique_ptr<storage> elements;
+    uint64_t hash = 0;
+    size_t bytes = 0;
+
+    {
+        auto &shard = get_shard(id);
+        shared_lock<registry_mutex> shard_lock(shard.mutex);
+        auto *found = shard.find(id);
+
+        // queue does not exist
+        if (found == nullptr) {
+            count_failure(failure::missing_queue);
+
+            if (tracing()) {
+                debug_doesnt_exist(__func__, id);
+                debug_return(__func__, STRQUEUE_NO_ID);
+            }
+
+            return STRQUEUE_NO_ID;
+        }
+
+        const auto &entry = *found;
+        shared_lock<registry_mutex> lock(entry.mutex);
+        const auto &queue = entry;
+
+        // the strings of FIFO queues are in their rings
+        if (queue.fifo() != nullptr) {
+            count_failure(failure::rejected);
+
+            if (tracing()) {
+                debug_failed(__func__);
+                debug_return(__func__, STRQUEUE_NO_ID);
+            }
+
+            return STRQUEUE_NO_ID;
+        }
+
+        queue.count_read();
+        elements = queue.contents().clone();
+        hash = queue.content_hash();
+        bytes = queue.byte_size();
+    }
+
+    // registering takes a shard lock, possibly that of the source queue
+    unsigned long res = register_queue(move(elements), hash, bytes);
+
+    if (tracing())
+        debug_return(__func__, res);
+
+    return res;
+}
+
+size_t strqueue_find(unsigned long id, const char *str, size_t start) {
+    const call_scope scope(STRQUEUE_FN_FIND);
+
+    if (tracing())
+        debug_call(__func__, id, quoted{str}, start);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    if (found == nullptr || str == NULL) {
+        count_failure(found == nullptr ? failure::missing_queue : failure::rejected);
+
+        if (tracing()) {
+            // queue does not exist
+            if (found == nullptr)
+                debug_doesnt_exist(__func__, id);
+
+            if (str == NULL)
+                debug_failed(__func__);
+        }
+
+        return STRQUEUE_NOT_FOUND;
+    }
+
+    const auto &entry = *found;
+    shared_lock<registry_mutex> lock(entry.mutex);
+    const auto &queue = entry;
+
+    // FIFO queues have no positions
+    if (queue.fifo() != nullptr) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(__func__);
 
+        return STRQUEUE_NOT_FOUND;
+    }
 
-namespace {
+    queue.count_read();
+    const size_t res = queue.find(str, start);
 
-// prevents static initialisation order fiasco
-unsigned long &get_cnt(void) {
-    static unsigned long cnt = 0;
-    return cnt;
-}
+    if (tracing())
+        debug_return(__func__, res);
 
-// purpose same as above
-unordered_map<unsigned long, deque<string>> &get_queues(void) {
-    static unordered_map<unsigned long, deque<string>> queues 
-                = unordered_map<unsigned long, deque<string>>();
-    return queues;
+    return res;
 }
 
-// returns an empty queue for the sake of queue lexicographical comparison
-deque<string> &get_empty_queue(void) {
-    static deque<string> empty_queue = deque<string>();
-    return empty_queue;
-}
+int strqueue_contains(unsigned long id, const char *str) {
+    const call_scope scope(STRQUEUE_FN_CONTAINS);
+
+    if (tracing())
+        debug_call(__func__, id, quoted{str});
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    if (found == nullptr || str == NULL) {
+        count_failure(found == nullptr ? failure::missing_queue : failure::rejected);
+
+        if (tracing()) {
+            // queue does not exist
+            if (found == nullptr)
+                debug_doesnt_exist(__func__, id);
 
-deque<string>::const_iterator deque_get_iterator_at(const deque<string> &queue,
-                                                        size_t position) {
-    size_t index = 0;
-    auto it = queue.begin();
+            if (str == NULL)
+                debug_failed(__func__);
+
+            debug_return(__func__, 0);
+        }
 
-    while (index < position) {
-        ++index;
-        ++it;
+        return 0;
     }
 
-    return it;
-}
+    const auto &entry = *found;
+    shared_lock<registry_mutex> lock(entry.mutex);
+    const auto &queue = entry;
 
-// log information about the most recently called function
-inline void debug_call(string name, string params) {
-    cerr << name << "(" << params << ")\n";
-}
+    // the strings of FIFO queues are in their rings
+    if (queue.fifo() != nullptr) {
+        count_failure(failure::rejected);
 
-// log information about the current function's return value
-template<typename T>
-inline void debug_return(string name, T value) {
-    if constexpr (is_null_pointer<T>::value)
-        cerr << name << " returns NULL\n";
-    else if constexpr (is_integral<T>::value)
-        cerr << name << " returns " << value << "\n";
-    else if constexpr (is_same<T, const char*>::value)
-        cerr << name << " returns \"" << value << "\"\n";
-}
+        if (tracing()) {
+            debug_failed(__func__);
+            debug_return(__func__, 0);
+        }
 
-// log message that a void-type function execution ended
-inline void debug_done(string name) {
-    cerr << name << " done\n";
-}
+        return 0;
+    }
 
-// log error information about non-existent queue in the map
-inline void debug_doesnt_exist(string name, unsigned long id) {
-    cerr << name << ": queue " << id << " does not exist\n";
-}
+    queue.count_read();
+    const int res = queue.contains(str) ? 1 : 0;
 
-// log error information about invalid string position in queue
-inline void debug_doesnt_contain(string name, unsigned long id, size_t position) {
-    cerr << name << ": queue " << id << " does not contain string at position " 
-            << position << "\n";
-}
+    if (tracing())
+        debug_return(__func__, res);
 
-// log information that a function couldn't fulfill its purpose
-inline void debug_failed(string name) {
-    cerr << name <<" failed\n";
+    return res;
 }
-} // namespace
 
-namespace cxx {
+void strqueue_set_indexed(unsigned long id, int enabled) {
+    const call_scope scope(STRQUEUE_FN_SET_INDEXED);
 
-unsigned long strqueue_new(void) {
-    if constexpr (debug)
-        debug_call(__func__, "");
+    if (tracing())
+        debug_call(__func__, id, enabled);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    // queue does not exist
+    if (found == nullptr) {
+        count_failure(failure::missing_queue);
+
+        if (tracing())
+            debug_doesnt_exist(__func__, id);
+
+        return;
+    }
 
-    unsigned long &cnt = get_cnt();
+    auto &entry = *found;
+    unique_lock<registry_mutex> lock(entry.mutex);
 
-    // check if there are valid IDs
-    assert(cnt < numeric_limits<unsigned long>::max());
+    // FIFO queues are never searched
+    if (entry.fifo() != nullptr) {
+        count_failure(failure::rejected);
 
-    auto &queues = get_queues();
-    queues[cnt] = deque<string>();
+        if (tracing())
+            debug_failed(__func__);
+
+        return;
+    }
 
-    if constexpr (debug)
-        debug_return(__func__, cnt);
+    entry.set_indexed(enabled != 0);
 
-    return cnt++;
+    if (tracing())
+        debug_done(__func__);
 }
 
-void strqueue_delete(unsigned long id) {
-    if constexpr (debug) 
-        debug_call(__func__, to_string(id));
+void strqueue_set_compressible(unsigned long id, int enabled) {
+    const call_scope scope(STRQUEUE_FN_SET_COMPRESSIBLE);
+
+    if (tracing())
+        debug_call(__func__, id, enabled);
 
-    auto &queues = get_queues();
-    auto queue_it = queues.find(id);
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
 
     // queue does not exist
-    if (queue_it == queues.end()) {
-        if constexpr (debug)
+    if (found == nullptr) {
+        count_failure(failure::missing_queue);
+
+        if (tracing())
             debug_doesnt_exist(__func__, id);
-        
+
+        return;
+    }
+
+    auto &entry = *found;
+    unique_lock<registry_mutex> lock(entry.mutex);
+
+    // FIFO queues only hold strings in flight
+    if (entry.fifo() != nullptr) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(__func__);
+
         return;
     }
 
-    queues.erase(queue_it);
+    entry.set_compressible(enabled != 0);
 
-    if constexpr (debug)
+    if (tracing())
         debug_done(__func__);
 }
 
-size_t strqueue_size(unsigned long id) {
-    if constexpr (debug)
-        debug_call(__func__, to_string(id));
+size_t strqueue_compress_idle(void) {
+    const call_scope scope(STRQUEUE_FN_COMPRESS_IDLE);
 
-    auto &queues = get_queues();
-    auto queue_it = queues.find(id);
+    if (tracing())
+        debug_call(__func__);
 
-    // queue does not exist
-    if (queue_it == queues.end()) {
-        if constexpr (debug) {
-            debug_doesnt_exist(__func__, id);
-            debug_return(__func__, 0);
+    const size_t res = compress_idle_queues();
+
+    if (tracing())
+        debug_return(__func__, res);
+
+    return res;
+}
+
+void strqueue_set_idle_compression(unsigned long interval) {
+#ifdef STRQUEUE_THREAD_SAFE
+    get_idle_compressor().set_interval(interval);
+#else
+    (void)interval;
+#endif
+}
+
+void strqueue_comp_many(unsigned long ref, const unsigned long *ids, size_t n, int *out) {
+    const call_scope scope(STRQUEUE_FN_COMP_MANY);
+
+    if (tracing())
+        debug_call(__func__, ref, id_array{ids, n}, n);
+
+    if (n > 0 && (ids == NULL || out == NULL)) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(__func__);
+
+        return;
+    }
+
+    // the others are compared with a clone of the reference queue,
+    // so that it is not locked by every comparison
+    unique_ptr<storage> reference;
+
+    {
+        auto &shard = get_shard(ref);
+        shared_lock<registry_mutex> shard_lock(shard.mutex);
+        auto *found = shard.find(ref);
+        // if a queue does not exist, it is treated as an empty queue
+        const auto &entry = (found == nullptr) ? get_empty_queue() : *found;
+        shared_lock<registry_mutex> lock(entry.mutex);
+
+        if (found == nullptr) {
+            count_failure(failure::missing_queue);
+
+            if (tracing())
+                debug_doesnt_exist(__func__, ref);
+        }
+        else {
+            entry.count_read();
         }
 
-        return 0;
+        reference = entry.contents().clone();
     }
 
-    const auto &queue = queue_it->second;
+    atomic<size_t> missing{0};
 
-    if constexpr (debug)
-        debug_return(__func__, queue.size());
+    get_pool().run(n, [&](size_t i) {
+        auto &shard = get_shard(ids[i]);
+        shared_lock<registry_mutex> shard_lock(shard.mutex);
+        auto *found = shard.find(ids[i]);
+        const auto &entry = (found == nullptr) ? get_empty_queue() : *found;
+        shared_lock<registry_mutex> lock(entry.mutex);
 
-    return queue.size();
+        if (found == nullptr) {
+            missing.fetch_add(1, memory_order_relaxed);
+
+            if (tracing())
+                debug_doesnt_exist(__func__, ids[i]);
+        }
+        else {
+            entry.count_read();
+        }
+
+        // a queue is equal to itself, even if it has changed since it was cloned
+        out[i] = (found != nullptr && ids[i] == ref)
+                    ? 0 : storage_compare(*reference, entry.contents());
+    });
+
+    // counted here, against this function
+    for (size_t i = missing.load(memory_order_relaxed); i > 0; --i)
+        count_failure(failure::missing_queue);
+
+    if (tracing())
+        debug_done(__func__);
 }
 
-void strqueue_insert_at(unsigned long id, size_t position, const char *str) {
-    if constexpr (debug) {
-        if (str == NULL)
-            debug_call(__func__, to_string(id) + string(", ") 
-                            + to_string(position) + string(", NULL"));
-        else
-            debug_call(__func__, to_string(id) + string(", ") 
-                            + to_string(position) + string(", \"") 
-                            + str + string("\""));
+void strqueue_delete_many(const unsigned long *ids, size_t n) {
+    const call_scope scope(STRQUEUE_FN_DELETE_MANY);
+
+    if (tracing())
+        debug_call(__func__, id_array{ids, n}, n);
+
+    if (n > 0 && ids == NULL) {
+        count_failure(failure::rejected);
 
+        if (tracing())
+            debug_failed(__func__);
+
+        return;
     }
 
-    auto &queues = get_queues();
-    auto queue_it = queues.find(id);
-    string s;
+    // every shard is locked once, for all of its queues
+    vector<vector<unsigned long>> by_shard(shard_count);
 
-    if (queue_it == queues.end() || str == NULL) {
-        if constexpr (debug) {
-            // queue does not exist
-            if (queue_it == queues.end())
-                debug_doesnt_exist(__func__, id);
+    for (size_t i = 0; i < n; ++i)
+        by_shard[&get_shard(ids[i]) - get_shards().data()].push_back(ids[i]);
 
-            if(str == NULL)
-                debug_failed(__func__);
+    atomic<size_t> missing{0};
+
+    get_pool().run(shard_count, [&](size_t index) {
+        if (by_shard[index].empty())
+            return;
+
+        auto &shard = get_shards()[index];
+        unique_lock<registry_mutex> shard_lock(shard.mutex);
+
+        for (const unsigned long id : by_shard[index]) {
+            auto *found = shard.find(id);
+
+            // queue does not exist, or was given twice
+            if (found == nullptr) {
+                missing.fetch_add(1, memory_order_relaxed);
+
+                if (tracing())
+                    debug_doesnt_exist(__func__, id);
+
+                continue;
+            }
+
+            found->retire();
+            release_bytes(found->byte_size());
+            shard.erase(id);
         }
+    });
+
+    for (size_t i = missing.load(memory_order_relaxed); i > 0; --i)
+        count_failure(failure::missing_queue);
+
+    if (tracing())
+        debug_done(__func__);
+}
+
+void strqueue_clear_many(const unsigned long *ids, size_t n) {
+    const call_scope scope(STRQUEUE_FN_CLEAR_MANY);
+
+    if (tracing())
+        debug_call(__func__, id_array{ids, n}, n);
+
+    if (n > 0 && ids == NULL) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(__func__);
 
         return;
     }
 
-    auto &queue = queue_it->second;
+    atomic<size_t> missing{0}, failed{0};
 
-    s = str;
+    get_pool().run(n, [&](size_t i) {
+        auto &shard = get_shard(ids[i]);
+        shared_lock<registry_mutex> shard_lock(shard.mutex);
+        auto *found = shard.find(ids[i]);
 
-    if (queue.size() <= position)
-        queue.push_back(s);
-    else
-        queue.insert(deque_get_iterator_at(queue, position), s);
+        // queue does not exist
+        if (found == nullptr) {
+            missing.fetch_add(1, memory_order_relaxed);
+
+            if (tracing())
+                debug_doesnt_exist(__func__, ids[i]);
+
+            return;
+        }
+
+        unique_lock<registry_mutex> lock(found->mutex);
+
+        if (!found->clear()) {
+            failed.fetch_add(1, memory_order_relaxed);
+
+            if (tracing())
+                debug_failed(__func__);
+        }
+    });
+
+    for (size_t i = missing.load(memory_order_relaxed); i > 0; --i)
+        count_failure(failure::missing_queue);
+    for (size_t i = failed.load(memory_order_relaxed); i > 0; --i)
+        count_failure(failure::rejected);
 
-    if constexpr (debug) 
+    if (tracing())
         debug_done(__func__);
 }
 
-void strqueue_remove_at(unsigned long id, size_t position) {
-    if constexpr (debug)
-        debug_call(__func__, to_string(id) + string(", ") 
-                        + to_string(position));
+void strqueue_stats(struct strqueue_stats *stats) {
+    if (stats == NULL)
+        return;
+
+    memset(stats, 0, sizeof(*stats));
+
+    int64_t bytes = 0, packed_queues = 0, packed_bytes = 0;
+
+    get_metrics_registry().for_each([&](const thread_metrics &metrics) {
+        for (size_t f = 0; f < function_count; ++f) {
+            stats->calls[f] += metrics.calls[f].load(memory_order_relaxed);
+            stats->failures[f] += metrics.failures[f].load(memory_order_relaxed);
+            for (size_t b = 0; b < STRQUEUE_LATENCY_BUCKETS; ++b)
+                stats->latency[f][b] += metrics.latency[f][b].load(memory_order_relaxed);
+        }
+
+        stats->missing_queue += metrics.causes[size_t(failure::missing_queue)]
+                                    .load(memory_order_relaxed);
+        stats->bad_position += metrics.causes[size_t(failure::bad_position)]
+                                    .load(memory_order_relaxed);
+        stats->over_limit += metrics.causes[size_t(failure::over_limit)]
+                                    .load(memory_order_relaxed);
+        stats->rejected += metrics.causes[size_t(failure::rejected)]
+                                    .load(memory_order_relaxed);
+        bytes += metrics.bytes.load(memory_order_relaxed);
+        packed_queues += metrics.packed_queues.load(memory_order_relaxed);
+        packed_bytes += metrics.packed_bytes.load(memory_order_relaxed);
+        stats->decompressions += metrics.unpacks.load(memory_order_relaxed);
+    });
+
+    // counts of different threads may be read a moment apart
+    stats->bytes = bytes < 0 ? 0 : static_cast<unsigned long long>(bytes);
+    stats->compressed_queues = packed_queues < 0 ? 0
+                                : static_cast<unsigned long long>(packed_queues);
+    stats->compressed_bytes = packed_bytes < 0 ? 0
+                                : static_cast<unsigned long long>(packed_bytes);
+
+    for (auto &shard : get_shards()) {
+        shared_lock<registry_mutex> shard_lock(shard.mutex);
+        stats->live_queues += shard.queue_count();
+    }
+}
+
+int strqueue_queue_stats(unsigned long id, struct strqueue_queue_stats *stats) {
+    const call_scope scope(STRQUEUE_FN_QUEUE_STATS);
+
+    if (tracing())
+        debug_call(__func__, id);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
 
-    auto &queues = get_queues();
-    auto queue_it = queues.find(id);
-    auto &queue = (queue_it == queues.end()) 
-                    ? get_empty_queue() : queue_it->second;
+    if (found == nullptr || stats == NULL) {
+        count_failure(found == nullptr ? failure::missing_queue : failure::rejected);
 
-    if (queue_it == queues.end() || queue.size() <= position) {
-        if constexpr (debug) {
+        if (tracing()) {
             // queue does not exist
-            if (queue_it == queues.end())
+            if (found == nullptr)
                 debug_doesnt_exist(__func__, id);
-            // invalid element position
             else
-                debug_doesnt_contain(__func__, id, position);
+                debug_failed(__func__);
+
+            debug_return(__func__, 0);
         }
 
-        return;
+        return 0;
     }
 
-    queue.erase(deque_get_iterator_at(queue, position));
+    const auto &entry = *found;
+    shared_lock<registry_mutex> lock(entry.mutex);
+    const auto &queue = entry;
 
-    if constexpr (debug)
-        debug_done(__func__);
+    stats->size = queue.size();
+    stats->bytes = queue.byte_size();
+    stats->reads = queue.read_count();
+    stats->writes = queue.epoch();
+
+    if (tracing())
+        debug_return(__func__, 1);
+
+    return 1;
 }
 
-const char* strqueue_get_at(unsigned long id, size_t position) {
-    if constexpr (debug)
-        debug_call(__func__, to_string(id) + string(", ") 
-                        + to_string(position));
-
-    auto &queues = get_queues();
-    auto queue_it = queues.find(id);
-    const auto &queue = (queue_it == queues.end()) 
-                            ? get_empty_queue() : queue_it->second;
-    const char *res;
+size_t strqueue_bytes(unsigned long id) {
+    const call_scope scope(STRQUEUE_FN_BYTES);
 
-    if (queue_it == queues.end() || queue.size() <= position) {
-        if constexpr (debug) {
-            // queue does not exist
-            if (queue_it == queues.end())
-                debug_doesnt_exist(__func__, id);
-            // invalid element position
-            else
-                debug_doesnt_contain(__func__, id, position);
+    if (tracing())
+        debug_call(__func__, id);
 
-            debug_return(__func__, nullptr);
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    // queue does not exist
+    if (found == nullptr) {
+        count_failure(failure::missing_queue);
+
+        if (tracing()) {
+            debug_doesnt_exist(__func__, id);
+            debug_return(__func__, 0);
         }
 
-        return NULL;
+        return 0;
     }
 
-    res = deque_get_iterator_at(queue, position)->c_str();
-    if constexpr (debug)
-        debug_return(__func__, res);
+    const auto &entry = *found;
+    shared_lock<registry_mutex> lock(entry.mutex);
+    const auto &queue = entry;
 
-    return res;
+    if (tracing())
+        debug_return(__func__, queue.byte_size());
+
+    return queue.byte_size();
 }
 
-void strqueue_clear(unsigned long id) {
-    if constexpr (debug)
-        debug_call(__func__, to_string(id));
+void strqueue_set_byte_limit(unsigned long id, size_t limit) {
+    const call_scope scope(STRQUEUE_FN_SET_BYTE_LIMIT);
+
+    if (tracing())
+        debug_call(__func__, id, limit);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
+
+    // queue does not exist
+    if (found == nullptr) {
+        count_failure(failure::missing_queue);
+
+        if (tracing())
+            debug_doesnt_exist(__func__, id);
+
+        return;
+    }
+
+    auto &entry = *found;
+    unique_lock<registry_mutex> lock(entry.mutex);
+
+    entry.set_byte_limit(limit);
 
-    auto &queues = get_queues();
-    auto queue_it = queues.find(id);
+    if (tracing())
+        debug_done(__func__);
+}
+
+void strqueue_reserve(unsigned long id, size_t count, size_t bytes) {
+    const call_scope scope(STRQUEUE_FN_RESERVE);
+
+    if (tracing())
+        debug_call(__func__, id, count, bytes);
+
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
 
     // queue does not exist
-    if (queue_it == queues.end()) {
-        if constexpr (debug)
+    if (found == nullptr) {
+        count_failure(failure::missing_queue);
+
+        if (tracing())
             debug_doesnt_exist(__func__, id);
+
         return;
     }
 
-    auto &queue = queue_it->second;
+    auto &entry = *found;
+    unique_lock<registry_mutex> lock(entry.mutex);
+
+    // FIFO queues have a fixed capacity
+    if (entry.fifo() != nullptr) {
+        count_failure(failure::rejected);
 
-    queue.clear();
+        if (tracing())
+            debug_failed(__func__);
 
-    if constexpr (debug)
+        return;
+    }
+
+    entry.reserve(count, bytes);
+
+    if (tracing())
         debug_done(__func__);
 }
 
-int strqueue_comp(unsigned long id1, unsigned long id2) {
-    if constexpr (debug)
-        debug_call(__func__, to_string(id1) + string(", ") + to_string(id2));
+void strqueue_shrink_to_fit(unsigned long id) {
+    const call_scope scope(STRQUEUE_FN_SHRINK_TO_FIT);
 
-    const auto &queues = get_queues();
-    const auto q1_it = queues.find(id1), q2_it = queues.find(id2);
+    if (tracing())
+        debug_call(__func__, id);
 
-    // check if any of the queues does not exist
-    const bool not_in_1 = (q1_it == queues.end()), not_in_2 = (q2_it == queues.end());
-    // if a queue does not exist, it is treated as an empty queue
-    const auto &q1 = not_in_1 ? get_empty_queue() : q1_it->second;
-    const auto &q2 = not_in_2 ? get_empty_queue() : q2_it->second;
-    int res = 2;
+    auto &shard = get_shard(id);
+    shared_lock<registry_mutex> shard_lock(shard.mutex);
+    auto *found = shard.find(id);
 
-    if constexpr (debug) {
-        if(not_in_1)
-            debug_doesnt_exist(__func__, id1);
+    // queue does not exist
+    if (found == nullptr) {
+        count_failure(failure::missing_queue);
 
-        if(not_in_2)
-            debug_doesnt_exist(__func__, id2);       
+        if (tracing())
+            debug_doesnt_exist(__func__, id);
+
+        return;
     }
-    
-    if (q1 < q2)
-        res = -1;
-    else if (q1 > q2)
-        res = 1;
-    else res = 0;
 
-    if constexpr (debug)
-        debug_return(__func__, res);   
+    auto &entry = *found;
+    unique_lock<registry_mutex> lock(entry.mutex);
 
-    return res;
+    // FIFO queues have a fixed capacity
+    if (entry.fifo() != nullptr) {
+        count_failure(failure::rejected);
+
+        if (tracing())
+            debug_failed(__func__);
+
+        return;
+    }
+
+    entry.shrink_to_fit();
+
+    if (tracing())
+        debug_done(__func__);
+}
+
+void strqueue_set_global_byte_limit(size_t limit) {
+    global_byte_limit.store(limit, memory_order_relaxed);
+}
+
+void strqueue_set_deferred_reclaim(int enabled) {
+#ifdef STRQUEUE_THREAD_SAFE
+    deferred_reclaim.store(enabled != 0, memory_order_relaxed);
+#else
+    (void)enabled;
+#endif
+}
+
+void strqueue_reclaim_sync(void) {
+#ifdef STRQUEUE_THREAD_SAFE
+    get_reclaimer().sync();
+#endif
+}
+
+void strqueue_set_latency_sampling(unsigned int period) {
+    sampling_period.store(period, memory_order_relaxed);
+}
+
+const char *strqueue_function_name(int function) {
+    static const char *const names[] = {
+        "strqueue_new", "strqueue_new_ex", "strqueue_delete", "strqueue_size",
+        "strqueue_insert_at", "strqueue_insert_at_n", "strqueue_remove_at",
+        "strqueue_get_at", "strqueue_view_at", "strqueue_view_valid",
+        "strqueue_clear", "strqueue_comp", "strqueue_equal",
+        "strqueue_push_back_n", "strqueue_insert_range_at", "strqueue_remove_range",
+        "strqueue_get_range", "strqueue_new_fifo", "strqueue_push", "strqueue_pop",
+        "strqueue_open", "strqueue_snapshot", "strqueue_restore",
+        "strqueue_queue_stats", "strqueue_bytes", "strqueue_set_byte_limit",
+        "strqueue_clone", "strqueue_find", "strqueue_contains",
+        "strqueue_set_indexed", "strqueue_comp_many", "strqueue_delete_many",
+        "strqueue_clear_many", "strqueue_view_range", "strqueue_load_fd",
+        "strqueue_dump_fd", "strqueue_set_compressible", "strqueue_compress_idle",
+        "strqueue_new_with_capacity", "strqueue_reserve", "strqueue_shrink_to_fit",
+        "strqueue_new_on", "strqueue_fifo_acquire", "strqueue_fifo_release",
+        "strqueue_fifo_push", "strqueue_fifo_pop"
+    };
+
+    static_assert(std::size(names) == STRQUEUE_FN_COUNT, "missing function names");
+
+    if (function < 0 || function >= STRQUEUE_FN_COUNT)
+        return NULL;
+
+    return names[function];
+}
+
+void strqueue_set_tracing(int enabled) {
+    if constexpr (trace_compiled)
+        get_tracing().store(enabled != 0, memory_order_relaxed);
+}
+
+void strqueue_trace_flush(void) {
+    if constexpr (trace_compiled)
+        get_sink().flush();
 }
 } // namespace cxx
@@ -1,8 +1,29 @@
 #ifndef STRQUEUE_H
 #define STRQUEUE_H
+// queue kinds accepted by strqueue_new_ex
+#define STRQUEUE_DEQUE     0x0u
+#define STRQUEUE_TREE      0x1u
+#define STRQUEUE_ARENA     0x2u
+// elements are handles of strings shared by all queues of this kind
+#define STRQUEUE_INTERN    0x3u
+#define STRQUEUE_KIND_MASK 0xfu
+
+// FIFO queue kinds accepted by strqueue_new_fifo: an SPSC queue, the
+// default, may only be pushed to by one thread and popped by one other
+// thread at a time, which is not checked, and breaks without any error if
+// more threads do; an MPMC queue may be used by any number of threads
+#define STRQUEUE_FIFO_SPSC 0x0u
+#define STRQUEUE_FIFO_MPMC 0x1u
+
 #ifdef __cplusplus
+#include <cassert>
 #include <cstddef>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
 namespace cxx {
 extern "C" {
 #else
@@ -10,22 +31,604 @@ extern "C" {
 #endif
 unsigned long strqueue_new(void);
 
+unsigned long strqueue_new_ex(unsigned int flags);
+
+// a queue that count strings of length bytes in total (without the NULs)
+// are going to be added to; arena queues then store the strings without
+// allocating, others take it as a hint, see strqueue_reserve
+unsigned long strqueue_new_with_capacity(unsigned int flags, size_t count, size_t bytes);
+
+// node of strqueue_new_on meaning that of the calling thread
+#define STRQUEUE_LOCAL_NODE (-1)
+
+// a queue kept on NUMA node node in STRQUEUE_NUMA builds: its registry
+// shard is one of those of the node and the strings of arena queues are
+// stored in its memory; STRQUEUE_NO_ID if there is no such node;
+// the same as strqueue_new_ex in other builds
+unsigned long strqueue_new_on(unsigned int flags, int node);
+
 void strqueue_delete(unsigned long id);
 
 size_t strqueue_size(unsigned long id);
 
 void strqueue_insert_at(unsigned long id, size_t position, const char *str);
 
+void strqueue_insert_at_n(unsigned long id, size_t position, const char *str, 
+                            size_t len);
+
 void strqueue_remove_at(unsigned long id, size_t position);
 
 const char* strqueue_get_at(unsigned long id, size_t position);
 
+// a string in a queue together with its length; data stays valid and
+// unchanged until the next modification of the queue, which
+// strqueue_view_valid detects
+struct strqueue_view {
+    const char *data;
+    size_t len;
+    unsigned long id;
+    unsigned long epoch;
+};
+
+int strqueue_view_at(unsigned long id, size_t position, struct strqueue_view *view);
+
+int strqueue_view_valid(const struct strqueue_view *view);
+
+// views of up to count strings starting at position, stored in out;
+// returns how many there were, 0 if position is past the end
+size_t strqueue_view_range(unsigned long id, size_t position, size_t count,
+                            struct strqueue_view *out);
+
 void strqueue_clear(unsigned long id);
 
 int strqueue_comp(unsigned long id1, unsigned long id2);
 
+int strqueue_equal(unsigned long id1, unsigned long id2);
+
+void strqueue_push_back_n(unsigned long id, const char **strs, size_t n);
+
+void strqueue_insert_range_at(unsigned long id, size_t position, 
+                                const char **strs, size_t n);
+
+void strqueue_remove_range(unsigned long id, size_t position, size_t count);
+
+size_t strqueue_get_range(unsigned long id, size_t position, size_t count, 
+                            const char **out);
+
+// ID returned when no queue could be created
+#define STRQUEUE_NO_ID ((unsigned long)-1)
+
+// opens the queue stored in the file at path, creating it if there is
+// none, the strings live in path.data.N next to it; changes are written
+// through to the files and survive the process crashing at any point;
+// a change that cannot be written leaves the queue as it was and fails;
+// one process at a time may have a queue open, which a lock on path.lock
+// makes sure of, strqueue_delete closes
+// it and keeps the files, STRQUEUE_NO_ID is returned on failure
+unsigned long strqueue_open(const char *path);
+
+// writes every queue except FIFO and persistent ones to fd, together with
+// their IDs; returns 1 on success and 0 if writing failed
+int strqueue_snapshot(int fd);
+
+// replaces all queues with the ones in the snapshot read from fd, which keep
+// their IDs; no other strqueue function may run at the same time;
+// returns 1 on success and 0 if the snapshot is damaged or could not be read
+int strqueue_restore(int fd);
+
+// record formats of strqueue_load_fd and strqueue_dump_fd: strings ended
+// by '\n' (the last one may end at the end of the file instead), or every
+// string preceded by its length as a uint32_t in native byte order
+#define STRQUEUE_LINES           0x0u
+#define STRQUEUE_LENGTH_PREFIXED 0x1u
+
+// appends the records read from fd, from its offset to the end of
+// the file, to the queue; returns the number of strings appended,
+// which stop at the first record that cannot be read or appended
+size_t strqueue_load_fd(unsigned long id, int fd, unsigned int format);
+
+// writes all strings of the queue to fd as records; strings containing
+// '\n' are written as they are and read back as several lines;
+// returns 1 on success and 0 if writing failed
+int strqueue_dump_fd(unsigned long id, int fd, unsigned int format);
+
+// FIFO queues accept only strqueue_push / strqueue_pop besides
+// strqueue_size, strqueue_clear and strqueue_delete; positional
+// functions fail on them and strqueue_comp treats them as empty;
+// strqueue_clear, which pops every string, fails on SPSC queues,
+// since only their consumer thread may pop; flags is STRQUEUE_FIFO_SPSC,
+// which allows a single producer and a single consumer thread, or
+// STRQUEUE_FIFO_MPMC; the queue holds capacity strings rounded up to
+// a power of 2
+unsigned long strqueue_new_fifo(unsigned int flags, size_t capacity);
+
+int strqueue_push(unsigned long id, const char *str);
+
+// the returned string belongs to the caller, who must free() it
+char *strqueue_pop(unsigned long id);
+
+struct strqueue_fifo;
+
+// handle of FIFO queue id, NULL if there is no such FIFO queue;
+// strqueue_fifo_push and strqueue_fifo_pop reach the ring through it
+// without looking the queue up or taking any lock, and it keeps the ring
+// alive until it is released, even after the queue is deleted; the
+// thread contract of the queue's kind applies to the handles as well
+struct strqueue_fifo *strqueue_fifo_acquire(unsigned long id);
+
+void strqueue_fifo_release(struct strqueue_fifo *fifo);
+
+// same as strqueue_push; short strings are kept inside the ring,
+// so pushing them allocates nothing
+int strqueue_fifo_push(struct strqueue_fifo *fifo, const char *str);
+
+// pops the oldest string into buf if it fits in size bytes with its NUL
+// and returns buf, otherwise returns a malloc'ed string the caller must
+// free(); NULL if the queue is empty
+char *strqueue_fifo_pop(struct strqueue_fifo *fifo, char *buf, size_t size);
+
+// a new queue with the same strings as queue id, or STRQUEUE_NO_ID if
+// there is no such queue or it is a FIFO one; both share the strings until
+// either is modified, so cloning takes O(1) time and memory, except for
+// persistent queues, which are copied into an ordinary in-memory queue;
+// the first modification of either then copies only what it changes,
+// a few chunks of strings or a tree path, except for arena queues,
+// which copy all of their strings into a new arena
+unsigned long strqueue_clone(unsigned long id);
+
+// position returned by strqueue_find when there is no such element
+#define STRQUEUE_NOT_FOUND ((size_t)-1)
+
+// position of the first element equal to str at or after start,
+// STRQUEUE_NOT_FOUND if there is none
+size_t strqueue_find(unsigned long id, const char *str, size_t start);
+
+// 1 if the queue has an element equal to str, 0 otherwise
+int strqueue_contains(unsigned long id, const char *str);
+
+// an indexed queue keeps a hash table of its elements, which makes
+// strqueue_contains O(1) and lets strqueue_find return at once for absent
+// strings, at the cost of a copy of every element; the index is built when
+// it is enabled and is not carried over by strqueue_clone or snapshots
+void strqueue_set_indexed(unsigned long id, int enabled);
+
+// out[i] = strqueue_comp(ref, ids[i]) for every i < n, the comparisons
+// run in parallel in thread-safe builds; queues are compared with ref as
+// it was when the call started
+void strqueue_comp_many(unsigned long ref, const unsigned long *ids, size_t n, int *out);
+
+// same as strqueue_delete on each of the n queues, locking every part
+// of the registry only once
+void strqueue_delete_many(const unsigned long *ids, size_t n);
+
+// same as strqueue_clear on each of the n queues, in parallel
+// in thread-safe builds
+void strqueue_clear_many(const unsigned long *ids, size_t n);
+
+// with deferred reclamation on, strqueue_delete and strqueue_clear hand
+// the strings of large queues over to a background thread in O(1) instead
+// of freeing them; the queue or its ID can be used again right away;
+// only in thread-safe builds, others always free the strings at once
+void strqueue_set_deferred_reclaim(int enabled);
+
+// returns once all strings handed over so far have been freed
+void strqueue_reclaim_sync(void);
+
+// a compressible queue that nothing reads or modifies between two calls
+// of strqueue_compress_idle is packed by the second one into a single
+// block, compressed in builds with zlib, and unpacked by the next access;
+// views and pointers to its elements are invalidated by that as if it was
+// modified; off by default, FIFO queues cannot be compressed
+void strqueue_set_compressible(unsigned long id, int enabled);
+
+// compresses the compressible queues untouched since the previous call,
+// returns how many it has compressed
+size_t strqueue_compress_idle(void);
+
+// calls strqueue_compress_idle every interval milliseconds on a background
+// thread, 0 stops it; only in thread-safe builds, others call it themselves
+void strqueue_set_idle_compression(unsigned long interval);
+
+// functions counted by strqueue_stats
+enum strqueue_function {
+    STRQUEUE_FN_NEW,
+    STRQUEUE_FN_NEW_EX,
+    STRQUEUE_FN_DELETE,
+    STRQUEUE_FN_SIZE,
+    STRQUEUE_FN_INSERT_AT,
+    STRQUEUE_FN_INSERT_AT_N,
+    STRQUEUE_FN_REMOVE_AT,
+    STRQUEUE_FN_GET_AT,
+    STRQUEUE_FN_VIEW_AT,
+    STRQUEUE_FN_VIEW_VALID,
+    STRQUEUE_FN_CLEAR,
+    STRQUEUE_FN_COMP,
+    STRQUEUE_FN_EQUAL,
+    STRQUEUE_FN_PUSH_BACK_N,
+    STRQUEUE_FN_INSERT_RANGE_AT,
+    STRQUEUE_FN_REMOVE_RANGE,
+    STRQUEUE_FN_GET_RANGE,
+    STRQUEUE_FN_NEW_FIFO,
+    STRQUEUE_FN_PUSH,
+    STRQUEUE_FN_POP,
+    STRQUEUE_FN_OPEN,
+    STRQUEUE_FN_SNAPSHOT,
+    STRQUEUE_FN_RESTORE,
+    STRQUEUE_FN_QUEUE_STATS,
+    STRQUEUE_FN_BYTES,
+    STRQUEUE_FN_SET_BYTE_LIMIT,
+    STRQUEUE_FN_CLONE,
+    STRQUEUE_FN_FIND,
+    STRQUEUE_FN_CONTAINS,
+    STRQUEUE_FN_SET_INDEXED,
+    STRQUEUE_FN_COMP_MANY,
+    STRQUEUE_FN_DELETE_MANY,
+    STRQUEUE_FN_CLEAR_MANY,
+    STRQUEUE_FN_VIEW_RANGE,
+    STRQUEUE_FN_LOAD_FD,
+    STRQUEUE_FN_DUMP_FD,
+    STRQUEUE_FN_SET_COMPRESSIBLE,
+    STRQUEUE_FN_COMPRESS_IDLE,
+    STRQUEUE_FN_NEW_WITH_CAPACITY,
+    STRQUEUE_FN_RESERVE,
+    STRQUEUE_FN_SHRINK_TO_FIT,
+    STRQUEUE_FN_NEW_ON,
+    STRQUEUE_FN_FIFO_ACQUIRE,
+    STRQUEUE_FN_FIFO_RELEASE,
+    STRQUEUE_FN_FIFO_PUSH,
+    STRQUEUE_FN_FIFO_POP,
+    STRQUEUE_FN_COUNT
+};
+
+// latency bucket i counts calls that took from 2^i to 2^(i+1) ns
+#define STRQUEUE_LATENCY_BUCKETS 32
+
+// counters of the whole library; counts from all threads are added up
+// when read, so they are only approximately simultaneous
+struct strqueue_stats {
+    // indexed by enum strqueue_function
+    unsigned long long calls[STRQUEUE_FN_COUNT];
+    unsigned long long failures[STRQUEUE_FN_COUNT];
+    // failures by cause: a queue that does not exist, a position past
+    // the end, a byte limit, anything else (NULL strings, positional
+    // calls on FIFO queues, full FIFO queues, I/O errors)
+    unsigned long long missing_queue;
+    unsigned long long bad_position;
+    unsigned long long over_limit;
+    unsigned long long rejected;
+    unsigned long long live_queues;
+    // length of all strings in queues other than FIFO ones
+    unsigned long long bytes;
+    // queues kept compressed, the size of their compressed strings
+    // and how many times one was decompressed on access
+    unsigned long long compressed_queues;
+    unsigned long long compressed_bytes;
+    unsigned long long decompressions;
+    // sampled calls only, see strqueue_set_latency_sampling
+    unsigned long long latency[STRQUEUE_FN_COUNT][STRQUEUE_LATENCY_BUCKETS];
+};
+
+struct strqueue_queue_stats {
+    size_t size;
+    // length of all strings, 0 for FIFO queues
+    size_t bytes;
+    // calls reading and modifying the queue
+    unsigned long long reads;
+    unsigned long long writes;
+};
+
+void strqueue_stats(struct strqueue_stats *stats);
+
+// returns 0 if there is no such queue
+int strqueue_queue_stats(unsigned long id, struct strqueue_queue_stats *stats);
+
+// total length of the strings in a queue, kept up to date by every
+// modification; 0 for FIFO queues and queues that do not exist
+size_t strqueue_bytes(unsigned long id);
+
+// insertions that would take the bytes of the queue above limit are
+// ignored, 0 (the default) removes the limit
+void strqueue_set_byte_limit(unsigned long id, size_t limit);
+
+// makes room for count more strings of length bytes in total; arena queues
+// allocate their strings up front, small queues move into storage of their
+// kind, indexed ones grow the table, deque, tree and intern queues allocate
+// every string anyway and only their index is grown; invalidates views
+void strqueue_reserve(unsigned long id, size_t count, size_t bytes);
+
+// frees the memory a queue holds beyond its strings, compacting arena
+// queues; invalidates views
+void strqueue_shrink_to_fit(unsigned long id);
+
+// same for all queues together; threads keep up to 128 KiB each of
+// the limit in reserve for their next insertions
+void strqueue_set_global_byte_limit(size_t limit);
+
+// times every period-th call of each thread, 0 (the default) turns it off
+void strqueue_set_latency_sampling(unsigned int period);
+
+// name of a function counted by strqueue_stats, NULL for other values
+const char *strqueue_function_name(int function);
+
+void strqueue_set_tracing(int enabled);
+
+void strqueue_trace_flush(void);
+
 
 #ifdef __cplusplus
-}}
+}
+
+// C++ overloads of strqueue_insert_at; the first copies the string once,
+// the second takes it over without copying
+void strqueue_insert_at(unsigned long id, size_t position, std::string_view str);
+
+void strqueue_insert_at(unsigned long id, size_t position, std::string &&str);
+
+// owning C++ handle of a queue: creates the queue, or takes over an existing
+// ID, and deletes it when destroyed; elements are read through views fetched
+// block_size at a time, so that iterating looks the queue up once per block
+// instead of once per element; like pointers returned by strqueue_get_at,
+// elements and iterators are invalidated by modifications of the queue;
+// the cached views are not checked against the queue: modifications made
+// without the handle, through the C functions on its ID, and compressing
+// the queue with strqueue_compress_idle, which does not see reads served
+// from the cache, leave them dangling until refresh() is called;
+// a handle is used by one thread at a time
+class strqueue_handle {
+public:
+    class iterator;
+
+    using value_type = std::string_view;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using const_iterator = iterator;
+
+    static constexpr size_t block_size = 64;
+
+    explicit strqueue_handle(unsigned int flags = STRQUEUE_DEQUE)
+        : queue(strqueue_new_ex(flags)) {}
+
+    // id is deleted together with the handle
+    static strqueue_handle adopt(unsigned long id) {
+        strqueue_handle res(nullptr);
+        res.queue = id;
+        return res;
+    }
+
+    strqueue_handle(strqueue_handle &&other) noexcept
+        : queue(other.release()), block(std::move(other.block)) {}
+
+    strqueue_handle &operator=(strqueue_handle &&other) noexcept {
+        if (this != &other) {
+            reset();
+            queue = other.release();
+            block = std::move(other.block);
+        }
+
+        return *this;
+    }
+
+    ~strqueue_handle(void) {
+        reset();
+    }
+
+    unsigned long id(void) const {
+        return queue;
+    }
+
+    // gives up the queue without deleting it
+    unsigned long release(void) noexcept {
+        const unsigned long res = queue;
+
+        queue = STRQUEUE_NO_ID;
+        forget();
+        return res;
+    }
+
+    size_t size(void) const {
+        return strqueue_size(queue);
+    }
+
+    // drops the cached views, after the queue has been modified
+    // or compressed without the handle
+    void refresh(void) noexcept {
+        forget();
+    }
+
+    bool empty(void) const {
+        return size() == 0;
+    }
+
+    // position must be smaller than size()
+    std::string_view operator[](size_t position) const {
+        const strqueue_view &view = fetch(position);
+        return std::string_view(view.data, view.len);
+    }
+
+    iterator begin(void) const;
+
+    iterator end(void) const;
+
+    void insert(size_t position, std::string_view str) {
+        forget();
+        strqueue_insert_at(queue, position, str);
+    }
+
+    void push_back(std::string_view str) {
+        insert(static_cast<size_t>(-1), str);
+    }
+
+    void erase(size_t position) {
+        forget();
+        strqueue_remove_at(queue, position);
+    }
+
+    void clear(void) {
+        forget();
+        strqueue_clear(queue);
+    }
+
+    friend bool operator==(const strqueue_handle &q1, const strqueue_handle &q2) {
+        return strqueue_equal(q1.queue, q2.queue) != 0;
+    }
+
+    friend bool operator!=(const strqueue_handle &q1, const strqueue_handle &q2) {
+        return !(q1 == q2);
+    }
+
+    friend bool operator<(const strqueue_handle &q1, const strqueue_handle &q2) {
+        return strqueue_comp(q1.queue, q2.queue) < 0;
+    }
+
+private:
+    // views of the elements from first on, cached until the queue is modified
+    struct view_block {
+        size_t first = 0;
+        size_t count = 0;
+        strqueue_view views[block_size];
+    };
+
+    unsigned long queue;
+    mutable std::unique_ptr<view_block> block;
+
+    explicit strqueue_handle(std::nullptr_t) : queue(STRQUEUE_NO_ID) {}
+
+    void reset(void) {
+        if (queue != STRQUEUE_NO_ID)
+            strqueue_delete(queue);
+        queue = STRQUEUE_NO_ID;
+        forget();
+    }
+
+    void forget(void) noexcept {
+        if (block)
+            block->count = 0;
+    }
+
+    const strqueue_view &fetch(size_t position) const {
+        if (!block)
+            block.reset(new view_block);
+
+        // blocks are aligned, so that iterating backwards fetches
+        // each of them once as well
+        if (position - block->first >= block->count) {
+            block->first = position / block_size * block_size;
+            block->count = strqueue_view_range(queue, block->first, block_size, block->views);
+        }
+
+        assert(position - block->first < block->count);
+        return block->views[position - block->first];
+    }
+};
+
+// random-access iterator over the elements of a handle, yielding views
+class strqueue_handle::iterator {
+public:
+    using iterator_category = std::random_access_iterator_tag;
+    using iterator_concept = std::random_access_iterator_tag;
+    using value_type = std::string_view;
+    using difference_type = std::ptrdiff_t;
+    using reference = std::string_view;
+    using pointer = void;
+
+    iterator(void) = default;
+
+    reference operator*(void) const {
+        return (*handle)[position];
+    }
+
+    reference operator[](difference_type n) const {
+        return (*handle)[position + n];
+    }
+
+    iterator &operator++(void) {
+        ++position;
+        return *this;
+    }
+
+    iterator operator++(int) {
+        iterator res = *this;
+        ++position;
+        return res;
+    }
+
+    iterator &operator--(void) {
+        --position;
+        return *this;
+    }
+
+    iterator operator--(int) {
+        iterator res = *this;
+        --position;
+        return res;
+    }
+
+    iterator &operator+=(difference_type n) {
+        position += n;
+        return *this;
+    }
+
+    iterator &operator-=(difference_type n) {
+        position -= n;
+        return *this;
+    }
+
+    friend iterator operator+(iterator it, difference_type n) {
+        return it += n;
+    }
+
+    friend iterator operator+(difference_type n, iterator it) {
+        return it += n;
+    }
+
+    friend iterator operator-(iterator it, difference_type n) {
+        return it -= n;
+    }
+
+    friend difference_type operator-(const iterator &a, const iterator &b) {
+        return static_cast<difference_type>(a.position - b.position);
+    }
+
+    friend bool operator==(const iterator &a, const iterator &b) {
+        return a.position == b.position;
+    }
+
+    friend bool operator!=(const iterator &a, const iterator &b) {
+        return a.position != b.position;
+    }
+
+    friend bool operator<(const iterator &a, const iterator &b) {
+        return a.position < b.position;
+    }
+
+    friend bool operator>(const iterator &a, const iterator &b) {
+        return a.position > b.position;
+    }
+
+    friend bool operator<=(const iterator &a, const iterator &b) {
+        return a.position <= b.position;
+    }
+
+    friend bool operator>=(const iterator &a, const iterator &b) {
+        return a.position >= b.position;
+    }
+
+private:
+    friend class strqueue_handle;
+
+    const strqueue_handle *handle = nullptr;
+    size_t position = 0;
+
+    iterator(const strqueue_handle *h, size_t p) : handle(h), position(p) {}
+};
+
+inline strqueue_handle::iterator strqueue_handle::begin(void) const {
+    return iterator(this, 0);
+}
+
+inline strqueue_handle::iterator strqueue_handle::end(void) const {
+    return iterator(this, size());
+}
+}
 #endif
 #endif
\ No newline at end of file